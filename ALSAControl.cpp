@@ -36,9 +36,19 @@
 namespace android
 {
 
-ALSAControl::ALSAControl(const char *device)
+ALSAControl::ALSAControl(const char *device) :
+    mCaching(false)
 {
     snd_ctl_open(&mHandle, device, 0);
+
+    // Changes to the elements come in as events, read in handleEvents().
+    // Reads don't block, so draining them stops at the first -EAGAIN.
+    if (mHandle) {
+        mCaching = snd_ctl_subscribe_events(mHandle, 1) == 0 &&
+                   snd_ctl_nonblock(mHandle, 1) == 0;
+        if (!mCaching)
+            LOGW("Unable to subscribe to control events, not caching controls");
+    }
 }
 
 ALSAControl::~ALSAControl()
@@ -46,20 +56,48 @@ ALSAControl::~ALSAControl()
     if (mHandle) snd_ctl_close(mHandle);
 }
 
-status_t ALSAControl::get(const char *name, unsigned int &value, int index)
+//
+// Drop the cached entry of any element that was removed or whose info
+// changed. Value changes, our own writes among them, are read and ignored.
+// Called with mLock held.
+//
+void ALSAControl::handleEvents()
 {
-    if (!mHandle) {
-        LOGE("Control not initialized");
-        return NO_INIT;
+    if (!mCaching) return;
+
+    snd_ctl_event_t *event;
+    snd_ctl_event_alloca(&event);
+
+    while (snd_ctl_read(mHandle, event) > 0) {
+        if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM) continue;
+
+        unsigned int mask = snd_ctl_event_elem_get_mask(event);
+        if (mask != SND_CTL_EVENT_MASK_REMOVE && !(mask & SND_CTL_EVENT_MASK_INFO))
+            continue;
+
+        mElements.removeItem(String8(snd_ctl_event_elem_get_name(event)));
+    }
+}
+
+//
+// Find a control by name, from the cache when it has been looked up before.
+// Called with mLock held, after handleEvents().
+//
+status_t ALSAControl::lookup(const char *name, Element &element)
+{
+    String8 key(name);
+    ssize_t i = mElements.indexOfKey(key);
+
+    if (i >= 0) {
+        element = mElements.valueAt(i);
+        return NO_ERROR;
     }
 
     snd_ctl_elem_id_t *id;
     snd_ctl_elem_info_t *info;
-    snd_ctl_elem_value_t *control;
 
     snd_ctl_elem_id_alloca(&id);
     snd_ctl_elem_info_alloca(&info);
-    snd_ctl_elem_value_alloca(&control);
 
     snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
     snd_ctl_elem_id_set_name(id, name);
@@ -71,23 +109,50 @@ status_t ALSAControl::get(const char *name, unsigned int &value, int index)
         return BAD_VALUE;
     }
 
-    int count = snd_ctl_elem_info_get_count(info);
-    if (index >= count) {
-        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
+    element.numid = snd_ctl_elem_info_get_numid(info);
+    element.type = snd_ctl_elem_info_get_type(info);
+    element.count = snd_ctl_elem_info_get_count(info);
+    element.items = element.type == SND_CTL_ELEM_TYPE_ENUMERATED ?
+            snd_ctl_elem_info_get_items(info) : 0;
+
+    if (mCaching) mElements.add(key, element);
+
+    return NO_ERROR;
+}
+
+status_t ALSAControl::get(const char *name, unsigned int &value, int index)
+{
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
+    }
+
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
+    Element element;
+    status_t err = lookup(name, element);
+    if (err != NO_ERROR) return err;
+
+    if (index >= element.count) {
+        LOGE("Control '%s' index is out of range (%d >= %d)", name, index, element.count);
         return BAD_VALUE;
     }
 
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
+    snd_ctl_elem_value_t *control;
+    snd_ctl_elem_value_alloca(&control);
 
-    ret = snd_ctl_elem_read(mHandle, control);
+    snd_ctl_elem_value_set_numid(control, element.numid);
+
+    int ret = snd_ctl_elem_read(mHandle, control);
     if (ret < 0) {
         LOGE("Control '%s' cannot read element value: %d", name, ret);
+        mElements.removeItem(String8(name));
         return BAD_VALUE;
     }
 
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-    switch (type) {
+    switch (element.type) {
         case SND_CTL_ELEM_TYPE_BOOLEAN:
             value = snd_ctl_elem_value_get_boolean(control, index);
             break;
@@ -110,50 +175,31 @@ status_t ALSAControl::get(const char *name, unsigned int &value, int index)
     return NO_ERROR;
 }
 
-status_t ALSAControl::set(const char *name, unsigned int value, int index)
+//
+// Fill in and write one control. The value is cleared first, so a batch
+// can reuse it. Called with mLock held.
+//
+status_t ALSAControl::write(const char *name, const Element &element,
+                            snd_ctl_elem_value_t *control,
+                            unsigned int value, int index)
 {
-    if (!mHandle) {
-        LOGE("Control not initialized");
-        return NO_INIT;
-    }
-
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
+    int count = element.count;
 
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
-
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
-
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
-    }
-
-    int count = snd_ctl_elem_info_get_count(info);
     if (index >= count) {
         LOGE("Control '%s' index is out of range (%d >= %d)", name, index, count);
         return BAD_VALUE;
     }
 
+    snd_ctl_elem_value_clear(control);
+    snd_ctl_elem_value_set_numid(control, element.numid);
+
     if (index == -1)
         index = 0; // Range over all of them
     else
         count = index + 1; // Just do the one specified
 
-    snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
-
-    snd_ctl_elem_value_t *control;
-    snd_ctl_elem_value_alloca(&control);
-
-    snd_ctl_elem_info_get_id(info, id);
-    snd_ctl_elem_value_set_id(control, id);
-
     for (int i = index; i < count; i++)
-        switch (type) {
+        switch (element.type) {
             case SND_CTL_ELEM_TYPE_BOOLEAN:
                 snd_ctl_elem_value_set_boolean(control, i, value);
                 break;
@@ -173,40 +219,67 @@ status_t ALSAControl::set(const char *name, unsigned int value, int index)
                 break;
         }
 
-    ret = snd_ctl_elem_write(mHandle, control);
-    return (ret < 0) ? BAD_VALUE : NO_ERROR;
+    int ret = snd_ctl_elem_write(mHandle, control);
+    if (ret < 0) {
+        LOGE("Control '%s' cannot write element value: %d", name, ret);
+        mElements.removeItem(String8(name));
+        return BAD_VALUE;
+    }
+
+    return NO_ERROR;
 }
 
-status_t ALSAControl::set(const char *name, const char *value)
+status_t ALSAControl::set(const char *name, unsigned int value, int index)
 {
     if (!mHandle) {
         LOGE("Control not initialized");
         return NO_INIT;
     }
 
-    snd_ctl_elem_id_t *id;
-    snd_ctl_elem_info_t *info;
+    AutoMutex lock(mLock);
 
-    snd_ctl_elem_id_alloca(&id);
-    snd_ctl_elem_info_alloca(&info);
+    handleEvents();
 
-    snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
-    snd_ctl_elem_id_set_name(id, name);
-    snd_ctl_elem_info_set_id(info, id);
+    Element element;
+    status_t err = lookup(name, element);
+    if (err != NO_ERROR) return err;
 
-    int ret = snd_ctl_elem_info(mHandle, info);
-    if (ret < 0) {
-        LOGE("Control '%s' cannot get element info: %d", name, ret);
-        return BAD_VALUE;
+    snd_ctl_elem_value_t *control;
+    snd_ctl_elem_value_alloca(&control);
+
+    return write(name, element, control, value, index);
+}
+
+status_t ALSAControl::set(const char *name, const char *value)
+{
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
     }
 
-    int items = snd_ctl_elem_info_get_items(info);
-    for (int i = 0; i < items; i++) {
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
+    Element element;
+    status_t err = lookup(name, element);
+    if (err != NO_ERROR) return err;
+
+    snd_ctl_elem_info_t *info;
+    snd_ctl_elem_info_alloca(&info);
+
+    snd_ctl_elem_info_set_numid(info, element.numid);
+
+    for (int i = 0; i < element.items; i++) {
         snd_ctl_elem_info_set_item(info, i);
-        ret = snd_ctl_elem_info(mHandle, info);
+        int ret = snd_ctl_elem_info(mHandle, info);
         if (ret < 0) continue;
-        if (strcmp(value, snd_ctl_elem_info_get_item_name(info)) == 0)
-            return set(name, i, -1);
+        if (strcmp(value, snd_ctl_elem_info_get_item_name(info)) == 0) {
+            snd_ctl_elem_value_t *control;
+            snd_ctl_elem_value_alloca(&control);
+
+            return write(name, element, control, i, -1);
+        }
     }
 
     LOGE("Control '%s' has no enumerated value of '%s'", name, value);
@@ -214,4 +287,39 @@ status_t ALSAControl::set(const char *name, const char *value)
     return BAD_VALUE;
 }
 
+//
+// Events are checked and the value set up once for the whole list, rather
+// than once per control, and cached controls cost one write each.
+//
+status_t ALSAControl::set(const Setting *settings, size_t count)
+{
+    if (!mHandle) {
+        LOGE("Control not initialized");
+        return NO_INIT;
+    }
+
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
+    snd_ctl_elem_value_t *control;
+    snd_ctl_elem_value_alloca(&control);
+
+    status_t status = NO_ERROR;
+
+    for (size_t i = 0; i < count; i++) {
+        const Setting &setting = settings[i];
+        Element element;
+
+        status_t err = lookup(setting.name, element);
+        if (err == NO_ERROR)
+            err = write(setting.name, element, control, setting.value, setting.index);
+
+        if (err != NO_ERROR && status == NO_ERROR)
+            status = err;
+    }
+
+    return status;
+}
+
 };        // namespace android
@@ -0,0 +1,316 @@
+/* ALSAFanOut.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+// Weight of the latest delay difference in the drift average, as a shift.
+static const int DRIFT_AVERAGE_SHIFT = 4;
+
+// Time over which a drift is taken back out, and the most a sink may be
+// trimmed by. Crystals disagree by well under the limit.
+static const int DRIFT_CORRECTION_SECONDS = 2;
+static const int MAX_DRIFT_PPM = 1000;
+
+// ----------------------------------------------------------------------------
+
+ALSAFanOut::ALSAFanOut() :
+    mDevices(0),
+    mFormat(SND_PCM_FORMAT_UNKNOWN),
+    mToFloat(0)
+{
+    memset(mBuffers, 0, sizeof(mBuffers));
+}
+
+ALSAFanOut::~ALSAFanOut()
+{
+    close();
+
+    for (int i = 0; i < BUFFER_COUNT; i++)
+        free(mBuffers[i].data);
+}
+
+//
+// Each sink starts out as a copy of the primary handle's configuration, so
+// the module negotiates the same format, channels and rate where the card
+// allows. Any rate it ends up with is resampled to; channels must match.
+//
+status_t ALSAFanOut::open(alsa_handle_t *primary, uint32_t devices, int mode)
+{
+    close();
+
+    for (uint32_t left = devices; left; left &= left - 1) {
+        uint32_t device = left & -left;
+        Sink *sink = new Sink;
+
+        memset(sink, 0, sizeof(*sink));
+        sink->handle = *primary;
+        sink->handle.handle = 0;
+        sink->handle.curDev = 0;
+        sink->handle.curMode = 0;
+        sink->handle.modPrivate = 0;
+
+        status_t err = primary->module->open(&sink->handle, device, mode);
+
+        if (err == NO_ERROR && sink->handle.channels != primary->channels)
+            err = BAD_VALUE;
+
+        if (err != NO_ERROR) {
+            LOGW("Unable to open a copy of the output for device 0x%x", device);
+            primary->module->close(&sink->handle);
+            delete sink;
+            close();
+            return err;
+        }
+
+        // The module writes back the rate the card settled on.
+        if (sink->handle.sampleRate != primary->sampleRate)
+            LOGI("Resampling the copy for device 0x%x from %u to %u Hz", device,
+                    primary->sampleRate, sink->handle.sampleRate);
+
+        if (ALSAFormat::supported(sink->handle.format))
+            sink->fromFloat = ALSAFormat::converter(SND_PCM_FORMAT_FLOAT_LE,
+                    sink->handle.format, sink->handle.channels);
+
+        mSinks.push_back(sink);
+        mDevices |= device;
+    }
+
+    LOGI("Copying output to devices 0x%x", mDevices);
+
+    return NO_ERROR;
+}
+
+void ALSAFanOut::close()
+{
+    for (List<Sink *>::iterator it = mSinks.begin(); it != mSinks.end(); ++it) {
+        Sink *sink = *it;
+
+        sink->handle.module->close(&sink->handle);
+        delete sink->resampler;
+        delete sink;
+    }
+
+    mSinks.clear();
+    mDevices = 0;
+}
+
+void *ALSAFanOut::grow(int index, size_t bytes)
+{
+    if (bytes > mBuffers[index].size) {
+        void *data = realloc(mBuffers[index].data, bytes);
+        if (!data) return 0;
+
+        mBuffers[index].data = data;
+        mBuffers[index].size = bytes;
+    }
+
+    return mBuffers[index].data;
+}
+
+//
+// Compare how much each PCM has queued. Whatever the difference is once
+// both are running is kept as the baseline, and a sink that then gains on
+// the primary is consuming too slowly and is given fewer frames, and the
+// other way round.
+//
+void ALSAFanOut::trim(Sink *sink, alsa_handle_t *primary, snd_pcm_sframes_t delay)
+{
+    snd_pcm_t *pcm = sink->handle.handle;
+    snd_pcm_sframes_t sinkDelay;
+
+    if (snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING ||
+        snd_pcm_state(primary->handle) != SND_PCM_STATE_RUNNING ||
+        snd_pcm_delay(pcm, &sinkDelay) < 0) {
+        sink->locked = false;
+        return;
+    }
+
+    int32_t difference = (int64_t)sinkDelay * primary->sampleRate /
+                         sink->handle.sampleRate - delay;
+
+    if (!sink->locked) {
+        sink->locked = true;
+        sink->baseline = difference;
+        sink->drift = 0;
+    }
+
+    sink->drift += (difference - sink->baseline - sink->drift) >> DRIFT_AVERAGE_SHIFT;
+
+    int ppm = (int64_t)sink->drift * 1000000 /
+              ((int64_t)primary->sampleRate * DRIFT_CORRECTION_SECONDS);
+
+    if (ppm > MAX_DRIFT_PPM) ppm = MAX_DRIFT_PPM;
+    if (ppm < -MAX_DRIFT_PPM) ppm = -MAX_DRIFT_PPM;
+
+    if (ppm != sink->ppm) {
+        sink->ppm = ppm;
+        sink->resampler->setDrift(ppm);
+    }
+}
+
+//
+// Hand frames to a sink without ever waiting on it. Frames it has no room
+// for are dropped, so a stalled card can not hold up the primary.
+//
+void ALSAFanOut::writeSink(Sink *sink, const void *buffer, size_t frames)
+{
+    snd_pcm_t *pcm = sink->handle.handle;
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+
+    if (avail < 0) {
+        if (snd_pcm_recover(pcm, avail, 1) < 0) return;
+        sink->xruns++;
+        sink->locked = false;
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) return;
+    }
+
+    if (frames > (size_t)avail) {
+        sink->dropped += frames - avail;
+        frames = avail;
+    }
+
+    if (!frames) return;
+
+    snd_pcm_sframes_t n;
+
+    if (sink->handle.curAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        n = snd_pcm_mmap_writei(pcm, buffer, frames);
+    else
+        n = snd_pcm_writei(pcm, buffer, frames);
+
+    if (n < 0 && n != -EAGAIN) {
+        snd_pcm_recover(pcm, n, 1);
+        sink->xruns++;
+        sink->locked = false;
+    }
+}
+
+//
+// One conversion to float is shared by every sink, then each resamples to
+// its own rate, trimmed for drift, and converts to its own format. Sinks
+// that can not be converted only get data that already matches them.
+//
+void ALSAFanOut::write(alsa_handle_t *primary, const void *buffer, size_t frames)
+{
+    if (mSinks.empty() || !frames || !primary->handle) return;
+
+    unsigned int channels = primary->channels;
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(primary->handle, &delay) < 0 || delay < 0)
+        delay = 0;
+
+    if (primary->format != mFormat) {
+        mFormat = primary->format;
+        mToFloat = ALSAFormat::supported(mFormat) ?
+                ALSAFormat::converter(mFormat, SND_PCM_FORMAT_FLOAT_LE, channels) : 0;
+    }
+
+    float *in = 0;
+
+    if (mToFloat) {
+        in = static_cast<float *>(grow(BUFFER_FLOAT_IN,
+                frames * channels * sizeof(float)));
+        if (in) mToFloat(buffer, in, frames, channels);
+    }
+
+    for (List<Sink *>::iterator it = mSinks.begin(); it != mSinks.end(); ++it) {
+        Sink *sink = *it;
+        alsa_handle_t *handle = &sink->handle;
+
+        if (!handle->handle || handle->channels != channels) continue;
+
+        if (!in || !sink->fromFloat) {
+            if (handle->format == primary->format &&
+                handle->sampleRate == primary->sampleRate)
+                writeSink(sink, buffer, frames);
+            continue;
+        }
+
+        if (!sink->resampler || sink->resampler->inRate() != primary->sampleRate) {
+            delete sink->resampler;
+            sink->resampler = new ALSAResampler(primary->sampleRate,
+                    handle->sampleRate, channels, ALSAResampler::LOW_QUALITY);
+            sink->ppm = 0;
+            sink->locked = false;
+        }
+
+        trim(sink, primary, delay);
+
+        size_t inFrames = frames;
+        size_t outFrames = sink->resampler->outputFramesFor(frames);
+
+        float *out = static_cast<float *>(grow(BUFFER_FLOAT_OUT,
+                outFrames * channels * sizeof(float)));
+        void *pcm = grow(BUFFER_PCM,
+                snd_pcm_frames_to_bytes(handle->handle, outFrames));
+        if (!out || !pcm) continue;
+
+        sink->resampler->resample(in, &inFrames, out, &outFrames);
+        sink->fromFloat(out, pcm, outFrames, channels);
+
+        writeSink(sink, pcm, outFrames);
+    }
+}
+
+// Play out what the sinks hold, and start drift tracking over.
+void ALSAFanOut::standby()
+{
+    for (List<Sink *>::iterator it = mSinks.begin(); it != mSinks.end(); ++it) {
+        Sink *sink = *it;
+
+        if (sink->handle.handle) snd_pcm_drain(sink->handle.handle);
+        if (sink->resampler) sink->resampler->reset();
+
+        sink->locked = false;
+    }
+}
+
+void ALSAFanOut::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    for (List<Sink *>::iterator it = mSinks.begin(); it != mSinks.end(); ++it) {
+        Sink *sink = *it;
+
+        snprintf(buffer, SIZE, "Output copy: devices 0x%x at %u Hz, drift %d ppm, %u frames dropped, %u xruns\n",
+                sink->handle.curDev, sink->handle.sampleRate, sink->ppm,
+                sink->dropped, sink->xruns);
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
+}
+
+}       // namespace android
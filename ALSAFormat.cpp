@@ -0,0 +1,551 @@
+/* ALSAFormat.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+//
+// Float samples are full scale at +/-1.0. Integer samples are scaled by a
+// power of two, so that 16 bit data makes the round trip unchanged, and
+// clipped to their range on the way back.
+//
+
+static inline int32_t clip(float s, float scale, int32_t max)
+{
+    s *= scale;
+    if (s >= (float)max) return max;
+    if (s <= -(float)max - 1) return -max - 1;
+    return (int32_t)lrintf(s);
+}
+
+#if defined(__ARM_NEON__)
+// vcvtq_s32_f32() truncates, so nudge each lane half a step away from zero
+// first to round to nearest like clip().
+static inline int32x4_t roundToS32(float32x4_t s)
+{
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    uint32x4_t negative = vcltq_f32(s, vdupq_n_f32(0.0f));
+
+    return vcvtq_s32_f32(vaddq_f32(s, vbslq_f32(negative, vnegq_f32(half), half)));
+}
+#endif
+
+// ----------------------------------------------------------------------------
+
+static void s16ToFloat(const int16_t *src, float *dst, size_t samples)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(s)), 15));
+        vst1q_f32(dst + i + 4, vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(s)), 15));
+    }
+#elif defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(1.0f / 32768);
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+
+    for (; i < samples; i++)
+        dst[i] = src[i] * (1.0f / 32768);
+}
+
+static void floatToS16(const float *src, int16_t *dst, size_t samples)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+
+    for (; i + 8 <= samples; i += 8) {
+        int32x4_t lo = roundToS32(vmulq_f32(vld1q_f32(src + i), scale));
+        int32x4_t hi = roundToS32(vmulq_f32(vld1q_f32(src + i + 4), scale));
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#elif defined(__SSE2__)
+    // Clamp before converting, as infinities and NaN come back as INT_MIN.
+    // _mm_min_ps() returns its second operand for NaN, which clamps it to max.
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128 l = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 h = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+        __m128i lo = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(l, max), min));
+        __m128i hi = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(h, max), min));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+
+    for (; i < samples; i++)
+        dst[i] = clip(src[i], 32768.0f, 32767);
+}
+
+//
+// 32 bit containers, holding either full 32 bit samples or 24 bit ones
+// aligned to the low bits, which are sign extended from the top byte.
+//
+template <int bits>
+static void s32ToFloat(const int32_t *src, float *dst, size_t samples)
+{
+    const int shift = 32 - bits;
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    // Shifting by a negative count shifts right, keeping the sign.
+    const int32x4_t up = vdupq_n_s32(shift);
+    const int32x4_t down = vdupq_n_s32(-shift);
+
+    for (; i + 4 <= samples; i += 4) {
+        int32x4_t s = vshlq_s32(vshlq_s32(vld1q_s32(src + i), up), down);
+        vst1q_f32(dst + i, vcvtq_n_f32_s32(s, bits - 1));
+    }
+#elif defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(1.0f / (1U << (bits - 1)));
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        if (shift) s = _mm_srai_epi32(_mm_slli_epi32(s, shift), shift);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(s), scale));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        int32_t s = shift ? (int32_t)((uint32_t)src[i] << shift) >> shift : src[i];
+        dst[i] = s * (1.0f / (1U << (bits - 1)));
+    }
+}
+
+template <int bits>
+static void floatToS32(const float *src, int32_t *dst, size_t samples)
+{
+    const int32_t max = (int32_t)((1U << (bits - 1)) - 1);
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    // The conversion saturates at the 32 bit range, narrower samples are
+    // clamped on top of that.
+    const float32x4_t scale = vdupq_n_f32((float)(1U << (bits - 1)));
+    const int32x4_t hi = vdupq_n_s32(max);
+    const int32x4_t lo = vdupq_n_s32(-max - 1);
+
+    for (; i + 4 <= samples; i += 4) {
+        int32x4_t s = roundToS32(vmulq_f32(vld1q_f32(src + i), scale));
+        if (bits < 32) s = vmaxq_s32(vminq_s32(s, hi), lo);
+        vst1q_s32(dst + i, s);
+    }
+#elif defined(__SSE2__)
+    // Clamp before converting, as out of range values come back as INT_MIN.
+    // 2^31 - 128 is the largest float below 2^31.
+    const __m128 scale = _mm_set1_ps((float)(1U << (bits - 1)));
+    const __m128 hi = _mm_set1_ps(bits < 32 ? (float)max : 2147483520.0f);
+    const __m128 lo = _mm_set1_ps(-(float)max - 1);
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        s = _mm_max_ps(_mm_min_ps(s, hi), lo);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_cvtps_epi32(s));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        float s = src[i] * (float)(1U << (bits - 1));
+        dst[i] = s >= (float)max ? max :
+                 s <= -(float)max - 1 ? -max - 1 : (int32_t)lrintf(s);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+//
+// Sample traits: how one sample of each format is stored, and how it is
+// taken to and from float. Packed 24 bit samples are three bytes apart.
+//
+struct pcm_s8 {
+    typedef int8_t sample_t;
+    enum { stride = 1 };
+    static inline float load(const sample_t *p) { return *p * (1.0f / 128); }
+    static inline void store(sample_t *p, float s) { *p = clip(s, 128.0f, 127); }
+};
+
+struct pcm_s16 {
+    typedef int16_t sample_t;
+    enum { stride = 1 };
+    static inline float load(const sample_t *p) { return *p * (1.0f / 32768); }
+    static inline void store(sample_t *p, float s) { *p = clip(s, 32768.0f, 32767); }
+};
+
+struct pcm_s24 {
+    typedef int32_t sample_t;
+    enum { stride = 1 };
+    static inline float load(const sample_t *p) {
+        return ((int32_t)((uint32_t)*p << 8) >> 8) * (1.0f / (1 << 23));
+    }
+    static inline void store(sample_t *p, float s) {
+        *p = clip(s, (float)(1 << 23), (1 << 23) - 1);
+    }
+};
+
+struct pcm_s24_3 {
+    typedef uint8_t sample_t;
+    enum { stride = 3 };
+    static inline float load(const sample_t *p) {
+        return ((int32_t)((p[0] << 8) | (p[1] << 16) | (p[2] << 24)) >> 8) *
+               (1.0f / (1 << 23));
+    }
+    static inline void store(sample_t *p, float s) {
+        int32_t v = clip(s, (float)(1 << 23), (1 << 23) - 1);
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+    }
+};
+
+struct pcm_s32 {
+    typedef int32_t sample_t;
+    enum { stride = 1 };
+    static inline float load(const sample_t *p) { return *p * (1.0f / 2147483648.0f); }
+    static inline void store(sample_t *p, float s) {
+        s *= 2147483648.0f;
+        *p = s >= 2147483520.0f ? 0x7fffffff :
+             s <= -2147483648.0f ? (int32_t)0x80000000 : (int32_t)lrintf(s);
+    }
+};
+
+struct pcm_float {
+    typedef float sample_t;
+    enum { stride = 1 };
+    static inline float load(const sample_t *p) { return *p; }
+    static inline void store(sample_t *p, float s) { *p = s; }
+};
+
+//
+// Conversion kernels, one per source format, destination format and channel
+// count. A channel count of 0 is the fallback for layouts without their own
+// kernel and takes the count at run time. The generic kernel is a plain loop
+// over traits the compiler sees through; the pairs that matter most on the
+// way through the resampler use the vector routines above instead.
+//
+template <class From, class To, int N>
+struct kernel {
+    static void run(const void *src, void *dst, size_t frames,
+                    unsigned int channels)
+    {
+        const typename From::sample_t *s =
+                static_cast<const typename From::sample_t *>(src);
+        typename To::sample_t *d = static_cast<typename To::sample_t *>(dst);
+        size_t samples = frames * (N ? N : channels);
+
+        for (size_t i = 0; i < samples; i++, s += From::stride, d += To::stride)
+            To::store(d, From::load(s));
+    }
+};
+
+template <class Format, int N>
+struct kernel<Format, Format, N> {
+    static void run(const void *src, void *dst, size_t frames,
+                    unsigned int channels)
+    {
+        memcpy(dst, src, frames * (N ? N : channels) *
+                Format::stride * sizeof(typename Format::sample_t));
+    }
+};
+
+#define VECTOR_KERNEL(From, To, function, ...)                              \
+    template <int N>                                                        \
+    struct kernel<From, To, N> {                                            \
+        static void run(const void *src, void *dst, size_t frames,          \
+                        unsigned int channels)                              \
+        {                                                                   \
+            function __VA_ARGS__ (                                          \
+                    static_cast<const From::sample_t *>(src),               \
+                    static_cast<To::sample_t *>(dst),                       \
+                    frames * (N ? N : channels));                           \
+        }                                                                   \
+    };
+
+VECTOR_KERNEL(pcm_s16, pcm_float, s16ToFloat)
+VECTOR_KERNEL(pcm_float, pcm_s16, floatToS16)
+VECTOR_KERNEL(pcm_s24, pcm_float, s32ToFloat, <24>)
+VECTOR_KERNEL(pcm_float, pcm_s24, floatToS32, <24>)
+VECTOR_KERNEL(pcm_s32, pcm_float, s32ToFloat, <32>)
+VECTOR_KERNEL(pcm_float, pcm_s32, floatToS32, <32>)
+
+#undef VECTOR_KERNEL
+
+//
+// Gain ramps. The gain moves by a fixed step per frame so the change is
+// spread over the whole buffer instead of landing on one sample. The
+// generic ramp goes through the traits; 16 bit stereo and mono, which is
+// what nearly every codec takes, scale four samples at a time.
+//
+template <class Format>
+struct ramp {
+    static void run(const void *src, void *dst, size_t frames,
+                    unsigned int channels, const float *from, const float *to)
+    {
+        const typename Format::sample_t *s =
+                static_cast<const typename Format::sample_t *>(src);
+        typename Format::sample_t *d =
+                static_cast<typename Format::sample_t *>(dst);
+
+        for (unsigned int c = 0; c < channels; c++) {
+            float gain = from[c];
+            float step = frames ? (to[c] - from[c]) / frames : 0;
+            size_t stride = channels * Format::stride;
+
+            for (size_t f = 0; f < frames; f++, gain += step)
+                Format::store(d + f * stride + c * Format::stride,
+                              Format::load(s + f * stride + c * Format::stride) * gain);
+        }
+    }
+};
+
+template <>
+struct ramp<pcm_s16> {
+    static void run(const void *src, void *dst, size_t frames,
+                    unsigned int channels, const float *from, const float *to)
+    {
+        const int16_t *s = static_cast<const int16_t *>(src);
+        int16_t *d = static_cast<int16_t *>(dst);
+        size_t f = 0;
+
+#if defined(__ARM_NEON__) || defined(__SSE2__)
+        if (channels <= 2 && frames) {
+            // Gains for four consecutive samples, and how far they move
+            // from one group of four to the next.
+            float g[4], inc[4];
+
+            for (int k = 0; k < 4; k++) {
+                unsigned int c = k % channels;
+                float step = (to[c] - from[c]) / frames;
+                g[k] = from[c] + step * (k / channels);
+                inc[k] = step * (4 / channels);
+            }
+
+            size_t samples = frames * channels;
+            size_t i = 0;
+
+#if defined(__ARM_NEON__)
+            float32x4_t gain = vld1q_f32(g);
+            float32x4_t delta = vld1q_f32(inc);
+
+            for (; i + 8 <= samples; i += 8) {
+                int16x8_t v = vld1q_s16(s + i);
+                float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+                float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+
+                lo = vmulq_f32(lo, gain);
+                gain = vaddq_f32(gain, delta);
+                hi = vmulq_f32(hi, gain);
+                gain = vaddq_f32(gain, delta);
+
+                vst1q_s16(d + i, vcombine_s16(vqmovn_s32(roundToS32(lo)),
+                                              vqmovn_s32(roundToS32(hi))));
+            }
+#else
+            __m128 gain = _mm_loadu_ps(g);
+            __m128 delta = _mm_loadu_ps(inc);
+
+            for (; i + 8 <= samples; i += 8) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+                __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+                __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+
+                lo = _mm_mul_ps(lo, gain);
+                gain = _mm_add_ps(gain, delta);
+                hi = _mm_mul_ps(hi, gain);
+                gain = _mm_add_ps(gain, delta);
+
+                _mm_storeu_si128((__m128i *)(d + i),
+                        _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+            }
+#endif
+
+            f = i / channels;
+        }
+#endif
+
+        for (unsigned int c = 0; c < channels && f < frames; c++) {
+            float step = (to[c] - from[c]) / frames;
+            float gain = from[c] + step * f;
+
+            for (size_t n = f; n < frames; n++, gain += step)
+                d[n * channels + c] = clip(s[n * channels + c], gain, 32767);
+        }
+    }
+};
+
+// The formats converted, in the order of the kernel table.
+static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_S8,
+    SND_PCM_FORMAT_S16_LE,
+    SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S24_3LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+// Channel counts with their own kernels, after the run time fallback.
+#define KERNEL_CHANNELS 3
+
+#define KERNELS(From, To) \
+    { kernel<From, To, 0>::run, kernel<From, To, 1>::run, kernel<From, To, 2>::run }
+
+#define KERNEL_ROW(From) {              \
+        KERNELS(From, pcm_s8),          \
+        KERNELS(From, pcm_s16),         \
+        KERNELS(From, pcm_s24),         \
+        KERNELS(From, pcm_s24_3),       \
+        KERNELS(From, pcm_s32),         \
+        KERNELS(From, pcm_float),       \
+    }
+
+static const ALSAFormat::convert_t kernels[FORMAT_COUNT][FORMAT_COUNT][KERNEL_CHANNELS] = {
+    KERNEL_ROW(pcm_s8),
+    KERNEL_ROW(pcm_s16),
+    KERNEL_ROW(pcm_s24),
+    KERNEL_ROW(pcm_s24_3),
+    KERNEL_ROW(pcm_s32),
+    KERNEL_ROW(pcm_float),
+};
+
+#undef KERNEL_ROW
+#undef KERNELS
+
+static const ALSAFormat::ramp_t ramps[FORMAT_COUNT] = {
+    ramp<pcm_s8>::run,
+    ramp<pcm_s16>::run,
+    ramp<pcm_s24>::run,
+    ramp<pcm_s24_3>::run,
+    ramp<pcm_s32>::run,
+    ramp<pcm_float>::run,
+};
+
+static int formatIndex(snd_pcm_format_t format)
+{
+    for (size_t i = 0; i < FORMAT_COUNT; i++)
+        if (formats[i] == format) return i;
+
+    return -1;
+}
+
+// ----------------------------------------------------------------------------
+
+bool ALSAFormat::supported(snd_pcm_format_t format)
+{
+    return formatIndex(format) >= 0;
+}
+
+snd_pcm_format_t ALSAFormat::fromAudioSystem(int format)
+{
+    switch(format) {
+        case AudioSystem::PCM_16_BIT:
+            return SND_PCM_FORMAT_S16_LE;
+        case AudioSystem::PCM_8_BIT:
+            return SND_PCM_FORMAT_S8;
+        case ALSA_PCM_32_BIT:
+            return SND_PCM_FORMAT_S32_LE;
+        case ALSA_PCM_8_24_BIT:
+            return SND_PCM_FORMAT_S24_LE;
+        case ALSA_PCM_FLOAT:
+            return SND_PCM_FORMAT_FLOAT_LE;
+        case ALSA_PCM_24_BIT_PACKED:
+            return SND_PCM_FORMAT_S24_3LE;
+        default:
+            return SND_PCM_FORMAT_UNKNOWN;
+    }
+}
+
+int ALSAFormat::toAudioSystem(snd_pcm_format_t format)
+{
+    switch(format) {
+        case SND_PCM_FORMAT_S8:
+            return AudioSystem::PCM_8_BIT;
+        case SND_PCM_FORMAT_S32_LE:
+            return ALSA_PCM_32_BIT;
+        case SND_PCM_FORMAT_S24_LE:
+            return ALSA_PCM_8_24_BIT;
+        case SND_PCM_FORMAT_FLOAT_LE:
+            return ALSA_PCM_FLOAT;
+        case SND_PCM_FORMAT_S24_3LE:
+            return ALSA_PCM_24_BIT_PACKED;
+        default:
+            LOGE("No AudioSystem format for %s", snd_pcm_format_name(format));
+            // Fall through...
+        case SND_PCM_FORMAT_S16_LE:
+            return AudioSystem::PCM_16_BIT;
+    }
+}
+
+//
+// The kernel converting frames of one format to another, or 0 when either
+// format is not one the kernels know.
+//
+ALSAFormat::convert_t ALSAFormat::converter(snd_pcm_format_t from,
+                                            snd_pcm_format_t to,
+                                            unsigned int channels)
+{
+    int i = formatIndex(from);
+    int j = formatIndex(to);
+
+    if (i < 0 || j < 0) {
+        LOGE("Cannot convert %s to %s", snd_pcm_format_name(from),
+                snd_pcm_format_name(to));
+        return 0;
+    }
+
+    return kernels[i][j][channels < KERNEL_CHANNELS ? channels : 0];
+}
+
+ALSAFormat::ramp_t ALSAFormat::ramper(snd_pcm_format_t format)
+{
+    int i = formatIndex(format);
+
+    return i < 0 ? 0 : ramps[i];
+}
+
+}       // namespace android
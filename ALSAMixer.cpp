@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <math.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 #include <utils/Log.h>
@@ -38,6 +40,9 @@
 
 #define ALSA_NAME_MAX 128
 
+// Entries in each element's table of volume steps, over levels 0 to 1.
+#define VOLUME_STEPS 256
+
 #define ALSA_STRCAT(x,y) \
     if (strlen(x) + strlen(y) < ALSA_NAME_MAX) \
         strcat(x, y);
@@ -83,6 +88,8 @@ struct mixer_info_t
         elem(0),
         min(SND_MIXER_VOL_RANGE_MIN),
         max(SND_MIXER_VOL_RANGE_MAX),
+        level(1.0f),
+        queued(false),
         mute(false)
     {
     }
@@ -90,11 +97,28 @@ struct mixer_info_t
     snd_mixer_elem_t *elem;
     long              min;
     long              max;
-    long              volume;
+    long              volume;   // Step asked for
+    long              written;  // Step last written to the element
+    float             level;    // As last set, to carry over a rebind
+    bool              queued;
     bool              mute;
     char              name[ALSA_NAME_MAX];
+    long              steps[VOLUME_STEPS];
 };
 
+// FNV-1a, over element names.
+static uint32_t nameHash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 static int initMixer (snd_mixer_t **mixer, const char *name)
 {
     int err;
@@ -157,52 +181,82 @@ static const setVolume_t setVol[] = {
     snd_mixer_selem_set_capture_volume_all
 };
 
-ALSAMixer::ALSAMixer()
+typedef int (*getdBRange_t)(snd_mixer_elem_t*, long int*, long int*);
+
+static const getdBRange_t getdBRange[] = {
+    snd_mixer_selem_get_playback_dB_range,
+    snd_mixer_selem_get_capture_dB_range
+};
+
+typedef int (*askdBVolume_t)(snd_mixer_elem_t*, long int, int, long int*);
+
+static const askdBVolume_t askdBVolume[] = {
+    snd_mixer_selem_ask_playback_dB_vol,
+    snd_mixer_selem_ask_capture_dB_vol
+};
+
+//
+// Levels are linear amplitudes, so where the element has a dB scale a level
+// is taken to its dB value and the nearest step below that. Elements without
+// one are mapped linearly onto their steps, as before.
+//
+static void buildSteps(int stream, mixer_info_t *info)
 {
-    int err;
+    long mindB, maxdB;
+    bool dB = getdBRange[stream] (info->elem, &mindB, &maxdB) == 0 &&
+              mindB < maxdB;
+
+    for (int k = 0; k < VOLUME_STEPS; k++) {
+        float level = (float)k / (VOLUME_STEPS - 1);
+        long vol = info->min + level * (info->max - info->min);
+
+        if (dB && k) {
+            // In hundredths of a dB.
+            long gain = maxdB + lrintf(2000.0f * log10f(level));
+            if (gain < mindB) gain = mindB;
+
+            if (askdBVolume[stream] (info->elem, gain, -1, &vol) < 0)
+                vol = info->min + level * (info->max - info->min);
+        } else if (dB)
+            vol = info->min;
+
+        if (vol > info->max) vol = info->max;
+        if (vol < info->min) vol = info->min;
+
+        info->steps[k] = vol;
+    }
+}
+
+ALSAMixer::ALSAMixer() :
+    mQueued(false),
+    mStopping(false)
+{
+    memset(mIndex, 0, sizeof(mIndex));
 
     initMixer (&mMixer[SND_PCM_STREAM_PLAYBACK], "AndroidOut");
     initMixer (&mMixer[SND_PCM_STREAM_CAPTURE], "AndroidIn");
 
-    snd_mixer_selem_id_t *sid;
-    snd_mixer_selem_id_alloca(&sid);
-
     for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
 
         if (!mMixer[i]) continue;
 
-        mixer_info_t *info = mixerMasterProp[i].mInfo = new mixer_info_t;
-
-        property_get (mixerMasterProp[i].propName,
-                      info->name,
-                      mixerMasterProp[i].propDefault);
-
+        // One pass over the elements builds the index, and elements added
+        // later, after a codec hot-plug say, come in through the callback.
         for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
              elem;
-             elem = snd_mixer_elem_next(elem)) {
+             elem = snd_mixer_elem_next(elem))
+            addElement(i, elem);
 
-            if (!snd_mixer_selem_is_active(elem))
-                continue;
+        snd_mixer_set_callback_private(mMixer[i], this);
+        snd_mixer_set_callback(mMixer[i], mixerEvent);
 
-            snd_mixer_selem_get_id(elem, sid);
-
-            // Find PCM playback volume control element.
-            const char *elementName = snd_mixer_selem_id_get_name(sid);
+        mixer_info_t *info = mixerMasterProp[i].mInfo = new mixer_info_t;
 
-            if (info->elem == NULL &&
-                strcmp(elementName, info->name) == 0 &&
-                hasVolume[i] (elem)) {
+        property_get (mixerMasterProp[i].propName,
+                      info->name,
+                      mixerMasterProp[i].propDefault);
 
-                info->elem = elem;
-                getVolumeRange[i] (elem, &info->min, &info->max);
-                info->volume = info->max;
-                setVol[i] (elem, info->volume);
-                if (i == SND_PCM_STREAM_PLAYBACK &&
-                    snd_mixer_selem_has_playback_switch (elem))
-                    snd_mixer_selem_set_playback_switch_all (elem, 1);
-                break;
-            }
-        }
+        bind(i, info);
 
         LOGV("Mixer: master '%s' %s.", info->name, info->elem ? "found" : "not found");
 
@@ -214,42 +268,47 @@ ALSAMixer::ALSAMixer()
                           info->name,
                           mixerProp[j][i].propDefault);
 
-            for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mMixer[i]);
-                 elem;
-                 elem = snd_mixer_elem_next(elem)) {
+            bind(i, info);
 
-                if (!snd_mixer_selem_is_active(elem))
-                    continue;
-
-                snd_mixer_selem_get_id(elem, sid);
-
-                // Find PCM playback volume control element.
-                const char *elementName = snd_mixer_selem_id_get_name(sid);
-
-               if (info->elem == NULL &&
-                    strcmp(elementName, info->name) == 0 &&
-                    hasVolume[i] (elem)) {
-
-                    info->elem = elem;
-                    getVolumeRange[i] (elem, &info->min, &info->max);
-                    info->volume = info->max;
-                    setVol[i] (elem, info->volume);
-                    if (i == SND_PCM_STREAM_PLAYBACK &&
-                        snd_mixer_selem_has_playback_switch (elem))
-                        snd_mixer_selem_set_playback_switch_all (elem, 1);
-                    break;
-                }
-            }
             LOGV("Mixer: route '%s' %s.", info->name, info->elem ? "found" : "not found");
         }
     }
+
+    mWriter = new VolumeWriter(this);
+    if (mWriter->run("ALSAMixerVolume", PRIORITY_AUDIO) != NO_ERROR) {
+        LOGW("Unable to start the volume thread, writing volumes directly");
+        mWriter.clear();
+    }
+
     LOGV("mixer initialized.");
 }
 
 ALSAMixer::~ALSAMixer()
 {
+    if (mWriter != 0) {
+        {
+            AutoMutex lock(mLock);
+            mStopping = true;
+            mVolumeQueued.signal();
+        }
+        mWriter->requestExitAndWait();
+        mWriter.clear();
+    }
+
+    // Whatever is still queued goes out before the mixers close.
+    {
+        AutoMutex lock(mLock);
+        flushVolumes();
+    }
+
     for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
         if (mMixer[i]) snd_mixer_close (mMixer[i]);
+        for (int b = 0; b < INDEX_SIZE; b++)
+            while (mIndex[i][b]) {
+                IndexEntry *entry = mIndex[i][b];
+                mIndex[i][b] = entry->next;
+                delete entry;
+            }
         if (mixerMasterProp[i].mInfo) {
             delete mixerMasterProp[i].mInfo;
             mixerMasterProp[i].mInfo = NULL;
@@ -264,85 +323,299 @@ ALSAMixer::~ALSAMixer()
     LOGV("mixer destroyed.");
 }
 
-status_t ALSAMixer::setMasterVolume(float volume)
+//
+// Entries are appended, so a name shared by several elements finds them in
+// mixer order, as the linear search it replaces did.
+//
+void ALSAMixer::addElement(int stream, snd_mixer_elem_t *elem)
 {
-    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_PLAYBACK].mInfo;
-    if (!info || !info->elem) return INVALID_OPERATION;
+    IndexEntry *entry = new IndexEntry;
+
+    entry->owner = this;
+    entry->stream = stream;
+    entry->elem = elem;
+    entry->hash = nameHash(snd_mixer_selem_get_name(elem));
+    entry->next = 0;
+
+    IndexEntry **link = &mIndex[stream][entry->hash & (INDEX_SIZE - 1)];
+    while (*link) link = &(*link)->next;
+    *link = entry;
 
-    long minVol = info->min;
-    long maxVol = info->max;
+    snd_mixer_elem_set_callback_private(elem, entry);
+    snd_mixer_elem_set_callback(elem, elementEvent);
+}
+
+void ALSAMixer::removeElement(IndexEntry *entry)
+{
+    IndexEntry **link = &mIndex[entry->stream][entry->hash & (INDEX_SIZE - 1)];
 
-    // Make sure volume is between bounds.
-    long vol = minVol + volume * (maxVol - minVol);
-    if (vol > maxVol) vol = maxVol;
-    if (vol < minVol) vol = minVol;
+    while (*link && *link != entry) link = &(*link)->next;
+    if (*link) *link = entry->next;
+
+    delete entry;
+}
+
+// The first active element of that name with a volume control.
+snd_mixer_elem_t *ALSAMixer::findElement(int stream, const char *name) const
+{
+    if (!*name) return 0;
+
+    uint32_t hash = nameHash(name);
+
+    for (IndexEntry *entry = mIndex[stream][hash & (INDEX_SIZE - 1)];
+         entry; entry = entry->next)
+        if (entry->hash == hash &&
+            snd_mixer_selem_is_active(entry->elem) &&
+            hasVolume[stream] (entry->elem) &&
+            strcmp(snd_mixer_selem_get_name(entry->elem), name) == 0)
+            return entry->elem;
+
+    return 0;
+}
+
+//
+// Point a device at its element, if there is one now, and refresh the range.
+// An element found for the first time, or again after going away, is set to
+// the volume and switch state last asked for.
+//
+void ALSAMixer::bind(int stream, mixer_info_t *info)
+{
+    snd_mixer_elem_t *elem = findElement(stream, info->name);
+
+    if (!elem) {
+        info->elem = 0;
+        return;
+    }
+
+    long min, max;
+    getVolumeRange[stream] (elem, &min, &max);
+
+    if (elem == info->elem && min == info->min && max == info->max)
+        return;
+
+    info->elem = elem;
+    info->min = min;
+    info->max = max;
+    buildSteps(stream, info);
+
+    info->volume = info->steps[lrintf(info->level * (VOLUME_STEPS - 1))];
+    info->written = info->volume;
+    info->queued = false;
+    setVol[stream] (elem, info->volume);
+
+    if (stream == SND_PCM_STREAM_PLAYBACK &&
+        snd_mixer_selem_has_playback_switch (elem))
+        snd_mixer_selem_set_playback_switch_all (elem, !info->mute);
+    else if (stream == SND_PCM_STREAM_CAPTURE && info->mute &&
+             snd_mixer_selem_has_capture_switch (elem))
+        snd_mixer_selem_set_capture_switch_all (elem, 0);
+}
+
+void ALSAMixer::rebind(int stream)
+{
+    if (mixerMasterProp[stream].mInfo)
+        bind(stream, mixerMasterProp[stream].mInfo);
+
+    for (int j = 0; mixerProp[j][stream].device; j++)
+        if (mixerProp[j][stream].mInfo)
+            bind(stream, mixerProp[j][stream].mInfo);
+}
+
+int ALSAMixer::mixerEvent(snd_mixer_t *mixer, unsigned int mask,
+                          snd_mixer_elem_t *elem)
+{
+    ALSAMixer *self = static_cast<ALSAMixer *>(snd_mixer_get_callback_private(mixer));
+
+    if (!(mask & SND_CTL_EVENT_MASK_ADD)) return 0;
+
+    int stream = mixer == self->mMixer[SND_PCM_STREAM_PLAYBACK] ?
+            SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE;
+
+    self->addElement(stream, elem);
+    self->rebind(stream);
+
+    return 0;
+}
+
+//
+// Removal takes the element out of the index, and an element going active
+// or inactive, or changing range, is an info event. Devices are rebound on
+// either. Plain value changes need nothing.
+//
+int ALSAMixer::elementEvent(snd_mixer_elem_t *elem, unsigned int mask)
+{
+    IndexEntry *entry =
+            static_cast<IndexEntry *>(snd_mixer_elem_get_callback_private(elem));
+
+    if (!entry) return 0;
+
+    ALSAMixer *self = entry->owner;
+    int stream = entry->stream;
+
+    if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+        self->removeElement(entry);
+
+        if (mixerMasterProp[stream].mInfo &&
+            mixerMasterProp[stream].mInfo->elem == elem)
+            mixerMasterProp[stream].mInfo->elem = 0;
+
+        for (int j = 0; mixerProp[j][stream].device; j++)
+            if (mixerProp[j][stream].mInfo &&
+                mixerProp[j][stream].mInfo->elem == elem)
+                mixerProp[j][stream].mInfo->elem = 0;
+    } else if (!(mask & SND_CTL_EVENT_MASK_INFO))
+        return 0;
+
+    self->rebind(stream);
+
+    return 0;
+}
+
+//
+// Pick up whatever the mixers have reported since the last call. The poll
+// keeps this from ever waiting when there is nothing pending.
+//
+void ALSAMixer::handleEvents()
+{
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++) {
+        if (!mMixer[i]) continue;
+
+        int count = snd_mixer_poll_descriptors_count(mMixer[i]);
+        if (count <= 0) continue;
+
+        struct pollfd fds[count];
+        count = snd_mixer_poll_descriptors(mMixer[i], fds, count);
+
+        if (count > 0 && poll(fds, count, 0) > 0)
+            snd_mixer_handle_events(mMixer[i]);
+    }
+}
+
+//
+// Ask for a level, a no-op when it lands on the step already asked for.
+// Called with mLock held, and without a volume thread the step is written
+// straight away.
+//
+void ALSAMixer::queueVolume(mixer_info_t *info, float level)
+{
+    if (level > 1.0f) level = 1.0f;
+    if (level < 0.0f) level = 0.0f;
+
+    info->level = level;
+
+    long vol = info->steps[lrintf(level * (VOLUME_STEPS - 1))];
+    if (vol == info->volume) return;
 
     info->volume = vol;
-    snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+    info->queued = true;
+
+    if (mWriter == 0) {
+        flushVolumes();
+        return;
+    }
+
+    mQueued = true;
+    mVolumeQueued.signal();
+}
+
+bool ALSAMixer::writeVolumes()
+{
+    AutoMutex lock(mLock);
+
+    while (!mQueued && !mStopping)
+        mVolumeQueued.wait(mLock);
+
+    flushVolumes();
+
+    return !mStopping;
+}
+
+//
+// Write the steps asked for since the last pass, skipping any that ended up
+// back where the element already is. Called with mLock held.
+//
+void ALSAMixer::flushVolumes()
+{
+    mQueued = false;
+
+    for (int i = 0; i <= SND_PCM_STREAM_LAST; i++)
+        for (int j = -1; j < 0 || mixerProp[j][i].device; j++) {
+            mixer_info_t *info = j < 0 ? mixerMasterProp[i].mInfo :
+                                         mixerProp[j][i].mInfo;
+
+            if (!info || !info->queued) continue;
+            info->queued = false;
+
+            if (!info->elem || info->volume == info->written) continue;
+
+            setVol[i] (info->elem, info->volume);
+            info->written = info->volume;
+        }
+}
+
+status_t ALSAMixer::setMasterVolume(float volume)
+{
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
+    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_PLAYBACK].mInfo;
+    if (!info || !info->elem) return INVALID_OPERATION;
+
+    queueVolume(info, volume);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setMasterGain(float gain)
 {
-    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_CAPTURE].mInfo;
-    if (!info || !info->elem) return INVALID_OPERATION;
+    AutoMutex lock(mLock);
 
-    long minVol = info->min;
-    long maxVol = info->max;
+    handleEvents();
 
-    // Make sure volume is between bounds.
-    long vol = minVol + gain * (maxVol - minVol);
-    if (vol > maxVol) vol = maxVol;
-    if (vol < minVol) vol = minVol;
+    mixer_info_t *info = mixerMasterProp[SND_PCM_STREAM_CAPTURE].mInfo;
+    if (!info || !info->elem) return INVALID_OPERATION;
 
-    info->volume = vol;
-    snd_mixer_selem_set_capture_volume_all (info->elem, vol);
+    queueVolume(info, gain);
 
     return NO_ERROR;
 }
 
 status_t ALSAMixer::setVolume(uint32_t device, float left, float right)
 {
+    status_t status = INVALID_OPERATION;
+
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_PLAYBACK].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            long minVol = info->min;
-            long maxVol = info->max;
-
-            // Make sure volume is between bounds.
-            long vol = minVol + left * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
-
-            info->volume = vol;
-            snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+            queueVolume(info, left);
+            status = NO_ERROR;
         }
 
-    return NO_ERROR;
+    // INVALID_OPERATION when no element covers the device either.
+    return status;
 }
 
 status_t ALSAMixer::setGain(uint32_t device, float gain)
 {
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
             mixer_info_t *info = mixerProp[j][SND_PCM_STREAM_CAPTURE].mInfo;
             if (!info || !info->elem) return INVALID_OPERATION;
 
-            long minVol = info->min;
-            long maxVol = info->max;
-
-            // Make sure volume is between bounds.
-            long vol = minVol + gain * (maxVol - minVol);
-            if (vol > maxVol) vol = maxVol;
-            if (vol < minVol) vol = minVol;
-
-            info->volume = vol;
-            snd_mixer_selem_set_capture_volume_all (info->elem, vol);
+            queueVolume(info, gain);
         }
 
     return NO_ERROR;
@@ -350,6 +623,10 @@ status_t ALSAMixer::setGain(uint32_t device, float gain)
 
 status_t ALSAMixer::setCaptureMuteState(uint32_t device, bool state)
 {
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
@@ -376,6 +653,10 @@ status_t ALSAMixer::getCaptureMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_CAPTURE].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_CAPTURE].device & device) {
 
@@ -391,6 +672,10 @@ status_t ALSAMixer::getCaptureMuteState(uint32_t device, bool *state)
 
 status_t ALSAMixer::setPlaybackMuteState(uint32_t device, bool state)
 {
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
@@ -417,6 +702,10 @@ status_t ALSAMixer::getPlaybackMuteState(uint32_t device, bool *state)
 {
     if (!state) return BAD_VALUE;
 
+    AutoMutex lock(mLock);
+
+    handleEvents();
+
     for (int j = 0; mixerProp[j][SND_PCM_STREAM_PLAYBACK].device; j++)
         if (mixerProp[j][SND_PCM_STREAM_PLAYBACK].device & device) {
 
@@ -0,0 +1,398 @@
+/* ALSARemixer.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+static const uint32_t FL  = AudioSystem::CHANNEL_OUT_FRONT_LEFT;
+static const uint32_t FR  = AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
+static const uint32_t FC  = AudioSystem::CHANNEL_OUT_FRONT_CENTER;
+static const uint32_t LFE = AudioSystem::CHANNEL_OUT_LOW_FREQUENCY;
+static const uint32_t BL  = AudioSystem::CHANNEL_OUT_BACK_LEFT;
+static const uint32_t BR  = AudioSystem::CHANNEL_OUT_BACK_RIGHT;
+static const uint32_t FLC = AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER;
+static const uint32_t FRC = AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER;
+static const uint32_t BC  = AudioSystem::CHANNEL_OUT_BACK_CENTER;
+
+static const float M3DB = 0.70710678f;
+
+//
+// Where a channel the output does not have goes instead. The rules are
+// tried in order and the first one whose targets are all present is used.
+// A channel no rule places is dropped.
+//
+struct fold_t {
+    uint32_t    from;
+    uint32_t    to[2];
+    float       gain;
+};
+
+static const fold_t folds[] = {
+    { FC,  { FL, FR }, M3DB },
+    { FC,  { FL, 0  }, 1.0f },
+    { LFE, { FC, 0  }, M3DB },
+    { LFE, { FL, FR }, 0.5f },
+    { LFE, { FL, 0  }, M3DB },
+    { BL,  { FL, 0  }, M3DB },
+    { BL,  { FC, 0  }, M3DB },
+    { BR,  { FR, 0  }, M3DB },
+    { BR,  { FL, 0  }, M3DB },
+    { BR,  { FC, 0  }, M3DB },
+    { BC,  { BL, BR }, M3DB },
+    { BC,  { FL, FR }, 0.5f },
+    { BC,  { FL, 0  }, M3DB },
+    { FLC, { FL, 0  }, 1.0f },
+    { FLC, { FC, 0  }, 1.0f },
+    { FRC, { FR, 0  }, 1.0f },
+    { FRC, { FL, 0  }, 1.0f },
+    { FRC, { FC, 0  }, 1.0f },
+    { FR,  { FL, 0  }, 1.0f },
+    { FR,  { FC, 0  }, 1.0f },
+    { FL,  { FC, 0  }, 1.0f },
+};
+
+#define FOLD_COUNT (sizeof(folds) / sizeof(folds[0]))
+
+// Index of a channel within the interleaved frames of a layout.
+static inline int channelIndex(uint32_t mask, uint32_t channel)
+{
+    return ALSARemixer::channelCount(mask & (channel - 1));
+}
+
+//
+// ALSA interleaves 5.1 as FL FR RL RR FC LFE and 7.1 with SL SR after that,
+// where AudioSystem puts the centre and LFE ahead of the back pair. The
+// extra pair of 7.1, left and right of centre here, goes out on the sides.
+// Quad is the same in both. A card with another map needs its PCM to route
+// the channels to these positions.
+//
+static const uint32_t order5point1[] = { FL, FR, BL, BR, FC, LFE };
+static const uint32_t order7point1[] = { FL, FR, BL, BR, FC, LFE, FLC, FRC };
+
+// ----------------------------------------------------------------------------
+
+ALSARemixer::ALSARemixer(uint32_t inMask, uint32_t outMask,
+                         const uint32_t *outOrder) :
+    mInMask(inMask),
+    mOutMask(outMask),
+    mOutOrder(outOrder),
+    mInChannels(channelCount(inMask)),
+    mOutChannels(channelCount(outMask)),
+    mMatrix(0),
+    mColumns(0)
+{
+    mMatrix = new float[mOutChannels * mInChannels];
+    mColumns = new float[((mOutChannels + 3) & ~3) * mInChannels];
+    reset();
+
+    LOGV("Remixing 0x%x to 0x%x", mInMask, mOutMask);
+}
+
+ALSARemixer::~ALSARemixer()
+{
+    delete[] mMatrix;
+    delete[] mColumns;
+}
+
+unsigned int ALSARemixer::channelCount(uint32_t mask)
+{
+    unsigned int count = 0;
+
+    for (; mask; mask &= mask - 1)
+        count++;
+
+    return count;
+}
+
+//
+// Capture layouts in terms of the playback positions, so one set of rules
+// covers both directions. A mono microphone is front centre.
+//
+uint32_t ALSARemixer::inputLayout(uint32_t mask)
+{
+    uint32_t layout = 0;
+
+    if (mask & AudioSystem::CHANNEL_IN_LEFT)  layout |= FL;
+    if (mask & AudioSystem::CHANNEL_IN_RIGHT) layout |= FR;
+    if (mask & AudioSystem::CHANNEL_IN_FRONT) layout |= FC;
+    if (mask & AudioSystem::CHANNEL_IN_BACK)  layout |= BC;
+
+    return layout;
+}
+
+const uint32_t *ALSARemixer::alsaOrder(uint32_t mask)
+{
+    switch (mask) {
+        case AudioSystem::CHANNEL_OUT_5POINT1:
+            return order5point1;
+        case AudioSystem::CHANNEL_OUT_7POINT1:
+            return order7point1;
+        default:
+            return 0;
+    }
+}
+
+int ALSARemixer::outIndex(uint32_t channel) const
+{
+    if (!mOutOrder) return channelIndex(mOutMask, channel);
+
+    for (unsigned int o = 0; o < mOutChannels; o++)
+        if (mOutOrder[o] == channel) return o;
+
+    return 0;
+}
+
+//
+// The default matrix: channels both layouts have pass straight through, a
+// mono source feeds both front speakers, and the rest fold down as above.
+// Rows summing to more than unity are scaled back so a downmix cannot clip.
+//
+void ALSARemixer::reset()
+{
+    memset(mMatrix, 0, mOutChannels * mInChannels * sizeof(float));
+
+    for (uint32_t in = mInMask; in; in &= in - 1) {
+        uint32_t channel = in & -in;
+        int i = channelIndex(mInMask, channel);
+
+        if (mInChannels == 1 && (mOutMask & (FL | FR)) == (FL | FR)) {
+            mMatrix[outIndex(FL) * mInChannels + i] = 1.0f;
+            mMatrix[outIndex(FR) * mInChannels + i] = 1.0f;
+            continue;
+        }
+
+        if (mOutMask & channel) {
+            mMatrix[outIndex(channel) * mInChannels + i] = 1.0f;
+            continue;
+        }
+
+        for (size_t r = 0; r < FOLD_COUNT; r++) {
+            const fold_t &fold = folds[r];
+
+            if (fold.from != channel) continue;
+            if (!(mOutMask & fold.to[0])) continue;
+            if (fold.to[1] && !(mOutMask & fold.to[1])) continue;
+
+            for (int t = 0; t < 2 && fold.to[t]; t++)
+                mMatrix[outIndex(fold.to[t]) * mInChannels + i] += fold.gain;
+            break;
+        }
+    }
+
+    for (unsigned int o = 0; o < mOutChannels; o++) {
+        float *row = mMatrix + o * mInChannels;
+        float sum = 0;
+
+        for (unsigned int i = 0; i < mInChannels; i++)
+            sum += fabsf(row[i]);
+
+        if (sum > 1.0f)
+            for (unsigned int i = 0; i < mInChannels; i++)
+                row[i] /= sum;
+    }
+
+    updateColumns();
+}
+
+//
+// Replace the matrix with one given row by row, one row per output channel
+// with one gain per input channel.
+//
+status_t ALSARemixer::setMatrix(const float *gains, size_t count)
+{
+    if (count != mOutChannels * mInChannels)
+        return BAD_VALUE;
+
+    memcpy(mMatrix, gains, count * sizeof(float));
+    updateColumns();
+
+    return NO_ERROR;
+}
+
+//
+// The matrix one input channel per row, each holding its gain into every
+// output channel, so that a frame is remixed by scaling whole rows.
+//
+void ALSARemixer::updateColumns()
+{
+    unsigned int stride = (mOutChannels + 3) & ~3;
+
+    memset(mColumns, 0, stride * mInChannels * sizeof(float));
+
+    for (unsigned int o = 0; o < mOutChannels; o++)
+        for (unsigned int i = 0; i < mInChannels; i++)
+            mColumns[i * stride + o] = mMatrix[o * mInChannels + i];
+}
+
+// ----------------------------------------------------------------------------
+
+#if defined(__ARM_NEON__)
+static inline void storeChannels(float *out, float32x4_t s, unsigned int count)
+{
+    if (count >= 4) {
+        vst1q_f32(out, s);
+    } else if (count == 2) {
+        vst1_f32(out, vget_low_f32(s));
+    } else {
+        float lanes[4];
+        vst1q_f32(lanes, s);
+        memcpy(out, lanes, count * sizeof(float));
+    }
+}
+#elif defined(__SSE2__)
+static inline void storeChannels(float *out, __m128 s, unsigned int count)
+{
+    if (count >= 4) {
+        _mm_storeu_ps(out, s);
+    } else if (count == 2) {
+        _mm_storel_pi((__m64 *)out, s);
+    } else {
+        float lanes[4];
+        _mm_storeu_ps(lanes, s);
+        memcpy(out, lanes, count * sizeof(float));
+    }
+}
+#endif
+
+void ALSARemixer::remix(const float *in, float *out, size_t frames) const
+{
+    size_t f = 0;
+
+    if (mInChannels == 2 && mOutChannels == 1) {
+        float l = mMatrix[0], r = mMatrix[1];
+
+#if defined(__ARM_NEON__)
+        for (; f + 4 <= frames; f += 4) {
+            float32x4x2_t s = vld2q_f32(in + f * 2);
+            vst1q_f32(out + f, vmlaq_n_f32(vmulq_n_f32(s.val[0], l), s.val[1], r));
+        }
+#elif defined(__SSE2__)
+        const __m128 gl = _mm_set1_ps(l), gr = _mm_set1_ps(r);
+
+        for (; f + 4 <= frames; f += 4) {
+            __m128 a = _mm_loadu_ps(in + f * 2);
+            __m128 b = _mm_loadu_ps(in + f * 2 + 4);
+            __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(out + f, _mm_add_ps(_mm_mul_ps(left, gl),
+                                              _mm_mul_ps(right, gr)));
+        }
+#endif
+
+        for (; f < frames; f++)
+            out[f] = in[f * 2] * l + in[f * 2 + 1] * r;
+
+        return;
+    }
+
+    if (mInChannels == 1 && mOutChannels == 2) {
+        float l = mMatrix[0], r = mMatrix[1];
+
+#if defined(__ARM_NEON__)
+        for (; f + 4 <= frames; f += 4) {
+            float32x4_t s = vld1q_f32(in + f);
+            float32x4x2_t d;
+            d.val[0] = vmulq_n_f32(s, l);
+            d.val[1] = vmulq_n_f32(s, r);
+            vst2q_f32(out + f * 2, d);
+        }
+#elif defined(__SSE2__)
+        const __m128 gl = _mm_set1_ps(l), gr = _mm_set1_ps(r);
+
+        for (; f + 4 <= frames; f += 4) {
+            __m128 s = _mm_loadu_ps(in + f);
+            __m128 left = _mm_mul_ps(s, gl);
+            __m128 right = _mm_mul_ps(s, gr);
+            _mm_storeu_ps(out + f * 2, _mm_unpacklo_ps(left, right));
+            _mm_storeu_ps(out + f * 2 + 4, _mm_unpackhi_ps(left, right));
+        }
+#endif
+
+        for (; f < frames; f++) {
+            out[f * 2] = in[f] * l;
+            out[f * 2 + 1] = in[f] * r;
+        }
+
+        return;
+    }
+
+#if defined(__ARM_NEON__) || defined(__SSE2__)
+    // Any other layouts, quad, 5.1 and 7.1 among them: every input sample
+    // scales a row of up to eight output gains, kept in one or two vectors.
+    unsigned int stride = (mOutChannels + 3) & ~3;
+
+    if (stride <= 8) {
+        for (; f < frames; f++, in += mInChannels, out += mOutChannels) {
+            const float *col = mColumns;
+#if defined(__ARM_NEON__)
+            float32x4_t lo = vdupq_n_f32(0.0f), hi = lo;
+
+            for (unsigned int i = 0; i < mInChannels; i++, col += stride) {
+                lo = vmlaq_n_f32(lo, vld1q_f32(col), in[i]);
+                if (stride > 4) hi = vmlaq_n_f32(hi, vld1q_f32(col + 4), in[i]);
+            }
+#else
+            __m128 lo = _mm_setzero_ps(), hi = lo;
+
+            for (unsigned int i = 0; i < mInChannels; i++, col += stride) {
+                __m128 s = _mm_set1_ps(in[i]);
+                lo = _mm_add_ps(lo, _mm_mul_ps(s, _mm_loadu_ps(col)));
+                if (stride > 4)
+                    hi = _mm_add_ps(hi, _mm_mul_ps(s, _mm_loadu_ps(col + 4)));
+            }
+#endif
+            storeChannels(out, lo, mOutChannels);
+            if (stride > 4) storeChannels(out + 4, hi, mOutChannels - 4);
+        }
+
+        return;
+    }
+#endif
+
+    for (; f < frames; f++, in += mInChannels, out += mOutChannels) {
+        const float *row = mMatrix;
+
+        for (unsigned int o = 0; o < mOutChannels; o++, row += mInChannels) {
+            float acc = 0;
+
+            for (unsigned int i = 0; i < mInChannels; i++)
+                acc += row[i] * in[i];
+
+            out[o] = acc;
+        }
+    }
+}
+
+}       // namespace android
@@ -0,0 +1,326 @@
+/* ALSAResampler.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+//
+// Filter length, number of phases, whether to interpolate between adjacent
+// phases, Kaiser window beta and passband edge (as a fraction of the lower
+// Nyquist frequency) for each quality preset. The lengths are multiples of
+// eight so the dot products need no tail.
+//
+struct resampler_preset_t {
+    int     taps;
+    int     phases;
+    bool    interpolate;
+    double  beta;
+    double  rolloff;
+};
+
+static const resampler_preset_t presets[] = {
+    /* LOW_QUALITY  : */ {  8,  32, false, 5.0, 0.85 },
+    /* MED_QUALITY  : */ { 16, 128, true,  7.0, 0.91 },
+    /* HIGH_QUALITY : */ { 32, 256, true,  9.0, 0.95 },
+};
+
+#define PRESET_COUNT (sizeof(presets) / sizeof(presets[0]))
+
+// Input frames buffered on top of the filter length.
+static const size_t BLOCK_FRAMES = 512;
+
+// ----------------------------------------------------------------------------
+
+static inline float dot(const float *x, const float *h, int taps)
+{
+#if defined(__ARM_NEON__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < taps; i += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(h + i));
+
+    float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#elif defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < taps; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + i),
+                                               _mm256_loadu_ps(h + i)));
+
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                            _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+#elif defined(__SSE2__)
+    __m128 acc = _mm_setzero_ps();
+
+    for (int i = 0; i < taps; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i),
+                                         _mm_loadu_ps(h + i)));
+
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+#else
+    float acc = 0.0f;
+
+    for (int i = 0; i < taps; i++)
+        acc += x[i] * h[i];
+
+    return acc;
+#endif
+}
+
+// Zeroth order modified Bessel function of the first kind.
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+
+    return sum;
+}
+
+// ----------------------------------------------------------------------------
+
+ALSAResampler::ALSAResampler(uint32_t inRate, uint32_t outRate,
+                             unsigned int channels, int quality) :
+    mInRate(inRate),
+    mOutRate(outRate),
+    mChannels(channels),
+    mQuality(quality),
+    mFilter(0),
+    mBuffer(0),
+    mCapacity(0),
+    mFill(0),
+    mPosition(0),
+    mStep(0)
+{
+    if (mQuality < 0 || mQuality >= (int)PRESET_COUNT)
+        mQuality = DEFAULT_QUALITY;
+
+    const resampler_preset_t &preset = presets[mQuality];
+
+    mTaps = preset.taps;
+    mPhases = preset.phases;
+    mInterpolate = preset.interpolate;
+    mCapacity = mTaps + BLOCK_FRAMES;
+    mStep = ((uint64_t)mInRate << 32) / mOutRate;
+
+    mFilter = new float[(mPhases + 1) * mTaps];
+    mBuffer = new float[mChannels * mCapacity];
+
+    buildFilter(preset.beta, preset.rolloff);
+    reset();
+
+    LOGV("Resampling %u to %u Hz, %d taps, %d phases", mInRate, mOutRate,
+            mTaps, mPhases);
+}
+
+ALSAResampler::~ALSAResampler()
+{
+    delete[] mFilter;
+    delete[] mBuffer;
+}
+
+//
+// Windowed sinc, one row per phase plus one so that interpolation can look
+// at the next phase. Row p is centred p / mPhases of a frame before the
+// middle of the filter, and every row is normalised to unity gain at DC.
+//
+void ALSAResampler::buildFilter(double beta, double rolloff)
+{
+    double cutoff = rolloff * (mOutRate < mInRate ?
+            (double)mOutRate / mInRate : 1.0);
+    double half = mTaps / 2;
+    double norm = besselI0(beta);
+
+    for (int p = 0; p <= mPhases; p++) {
+        float *row = mFilter + p * mTaps;
+        double sum = 0;
+
+        for (int k = 0; k < mTaps; k++) {
+            double d = k - (half - 1) - (double)p / mPhases;
+            double u = d / half;
+            double w = fabs(u) < 1 ? besselI0(beta * sqrt(1 - u * u)) / norm : 0;
+            double s = d == 0 ? 1 : sin(M_PI * cutoff * d) / (M_PI * cutoff * d);
+
+            row[k] = cutoff * s * w;
+            sum += row[k];
+        }
+
+        for (int k = 0; k < mTaps; k++)
+            row[k] /= sum;
+    }
+}
+
+//
+// Start over with silent history. The history is half a filter long, so the
+// first output frame lines up with the first input frame.
+//
+void ALSAResampler::reset()
+{
+    mFill = mTaps / 2 - 1;
+    mPosition = 0;
+
+    memset(mBuffer, 0, mChannels * mCapacity * sizeof(float));
+}
+
+void ALSAResampler::setDrift(int ppm)
+{
+    mStep = ((uint64_t)mInRate << 32) / mOutRate;
+    mStep += (int64_t)mStep * ppm / 1000000;
+}
+
+size_t ALSAResampler::inputFramesFor(size_t outFrames) const
+{
+    if (!outFrames) return 0;
+
+    size_t last = (mPosition + (outFrames - 1) * mStep) >> 32;
+    size_t need = last + mTaps;
+
+    return need > mFill ? need - mFill : 0;
+}
+
+size_t ALSAResampler::outputFramesFor(size_t inFrames) const
+{
+    size_t total = mFill + inFrames;
+
+    if (total < (size_t)mTaps) return 0;
+
+    uint64_t end = (uint64_t)(total - mTaps + 1) << 32;
+    if (end <= mPosition) return 0;
+
+    return (end - mPosition + mStep - 1) / mStep;
+}
+
+// Deinterleave as many input frames as fit behind the buffered ones.
+size_t ALSAResampler::append(const float *in, size_t frames)
+{
+    if (frames > mCapacity - mFill) frames = mCapacity - mFill;
+
+    for (unsigned int c = 0; c < mChannels; c++) {
+        float *dst = mBuffer + c * mCapacity + mFill;
+        const float *src = in + c;
+
+        for (size_t i = 0; i < frames; i++, src += mChannels)
+            dst[i] = *src;
+    }
+
+    mFill += frames;
+
+    return frames;
+}
+
+// Drop the frames the filter has moved past.
+size_t ALSAResampler::compact()
+{
+    size_t drop = mPosition >> 32;
+    if (drop > mFill) drop = mFill;
+    if (!drop) return 0;
+
+    for (unsigned int c = 0; c < mChannels; c++) {
+        float *row = mBuffer + c * mCapacity;
+        memmove(row, row + drop, (mFill - drop) * sizeof(float));
+    }
+
+    mFill -= drop;
+    mPosition -= (uint64_t)drop << 32;
+
+    return drop;
+}
+
+//
+// Run up to *inFrames interleaved input frames through the filter, writing
+// up to *outFrames interleaved output frames. Input that produces no output
+// yet is kept as history. On return both hold the counts actually used.
+//
+void ALSAResampler::resample(const float *in, size_t *inFrames,
+                             float *out, size_t *outFrames)
+{
+    size_t inDone = 0;
+    size_t outDone = 0;
+
+    for (;;) {
+        size_t index = mPosition >> 32;
+
+        if (outDone < *outFrames && index + mTaps <= mFill) {
+            uint32_t frac = (uint32_t)mPosition;
+            uint64_t phase = (uint64_t)frac * mPhases;
+
+            if (mInterpolate) {
+                const float *h0 = mFilter + (phase >> 32) * mTaps;
+                const float *h1 = h0 + mTaps;
+                float t = (float)(uint32_t)phase * (1.0f / 4294967296.0f);
+
+                for (unsigned int c = 0; c < mChannels; c++) {
+                    const float *x = mBuffer + c * mCapacity + index;
+                    float a = dot(x, h0, mTaps);
+                    float b = dot(x, h1, mTaps);
+                    *out++ = a + t * (b - a);
+                }
+            } else {
+                const float *h = mFilter +
+                        ((phase + 0x80000000ULL) >> 32) * mTaps;
+
+                for (unsigned int c = 0; c < mChannels; c++)
+                    *out++ = dot(mBuffer + c * mCapacity + index, h, mTaps);
+            }
+
+            mPosition += mStep;
+            outDone++;
+            continue;
+        }
+
+        if (inDone == *inFrames) break;
+
+        if (mFill == mCapacity && !compact()) break;
+
+        inDone += append(in + inDone * mChannels, *inFrames - inDone);
+    }
+
+    *inFrames = inDone;
+    *outFrames = outDone;
+}
+
+}       // namespace android
@@ -0,0 +1,190 @@
+/* ALSARingBuffer.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+//
+// The front and rear indices run freely over the whole 32 bit range and are
+// only masked when the buffer is accessed, so a full buffer can be told
+// apart from an empty one without wasting a byte.
+//
+// The size is a power of two and the frame size need not be, so a frame can
+// straddle the end. The first frameSize - 1 bytes of the buffer are mirrored
+// past its end, and a region may run into that guard to end on a frame.
+//
+ALSARingBuffer::ALSARingBuffer(size_t size, size_t frameSize) :
+    mBuffer(0),
+    mSize(1),
+    mFrameSize(frameSize ? frameSize : 1),
+    mFront(0),
+    mRear(0)
+{
+    while (mSize < size || mSize < mFrameSize)
+        mSize <<= 1;
+
+    mBuffer = static_cast<char *>(malloc(mSize + mFrameSize - 1));
+    if (!mBuffer) {
+        LOGE("Unable to allocate %u byte ring buffer", mSize);
+        mSize = 0;
+    }
+}
+
+ALSARingBuffer::~ALSARingBuffer()
+{
+    free(mBuffer);
+}
+
+size_t ALSARingBuffer::availableToRead() const
+{
+    uint32_t rear = android_atomic_acquire_load(&mRear);
+    uint32_t front = android_atomic_acquire_load(&mFront);
+
+    return rear - front;
+}
+
+size_t ALSARingBuffer::availableToWrite() const
+{
+    size_t avail = mSize - availableToRead();
+
+    return avail - avail % mFrameSize;
+}
+
+size_t ALSARingBuffer::write(const void *buffer, size_t bytes)
+{
+    uint32_t rear = mRear;
+    uint32_t front = android_atomic_acquire_load(&mFront);
+
+    size_t avail = mSize - (rear - front);
+    if (bytes > avail) bytes = avail;
+    bytes -= bytes % mFrameSize;
+
+    size_t offset = rear & (mSize - 1);
+    size_t part = mSize - offset;
+    if (part > bytes) part = bytes;
+
+    memcpy(mBuffer + offset, buffer, part);
+    memcpy(mBuffer, static_cast<const char *>(buffer) + part, bytes - part);
+
+    // Keep the guard in step with the start of the buffer.
+    size_t wrapped = bytes - part;
+    if (wrapped > mFrameSize - 1) wrapped = mFrameSize - 1;
+    memcpy(mBuffer + mSize, mBuffer, wrapped);
+
+    // Publish the data only once it has been copied in.
+    android_atomic_release_store(rear + bytes, &mRear);
+
+    return bytes;
+}
+
+size_t ALSARingBuffer::getWriteRegion(void **data) const
+{
+    uint32_t rear = mRear;
+    uint32_t front = android_atomic_acquire_load(&mFront);
+
+    size_t offset = rear & (mSize - 1);
+    size_t bytes = mSize - (rear - front);
+    if (bytes > contiguous(offset)) bytes = contiguous(offset);
+
+    *data = mBuffer + offset;
+
+    return bytes - bytes % mFrameSize;
+}
+
+void ALSARingBuffer::advanceWrite(size_t bytes)
+{
+    uint32_t rear = mRear;
+    size_t end = (rear & (mSize - 1)) + bytes;
+
+    // A frame written into the guard belongs at the start of the buffer.
+    if (end > mSize)
+        memcpy(mBuffer, mBuffer + mSize, end - mSize);
+
+    android_atomic_release_store(rear + bytes, &mRear);
+}
+
+size_t ALSARingBuffer::read(void *buffer, size_t bytes)
+{
+    char *dst = static_cast<char *>(buffer);
+    size_t done = 0;
+
+    while (done < bytes) {
+        const void *data;
+        size_t n = getReadRegion(&data);
+        if (!n) break;
+
+        if (n > bytes - done) n = bytes - done;
+        memcpy(dst + done, data, n);
+        advanceRead(n);
+        done += n;
+    }
+
+    return done;
+}
+
+size_t ALSARingBuffer::getReadRegion(const void **data) const
+{
+    uint32_t front = mFront;
+    uint32_t rear = android_atomic_acquire_load(&mRear);
+
+    size_t offset = front & (mSize - 1);
+    size_t bytes = rear - front;
+    if (bytes > contiguous(offset)) bytes = contiguous(offset);
+
+    *data = mBuffer + offset;
+
+    return bytes - bytes % mFrameSize;
+}
+
+//
+// Bytes from offset to the end of the buffer, running on into the guard to
+// the end of the frame that straddles it.
+//
+size_t ALSARingBuffer::contiguous(size_t offset) const
+{
+    size_t bytes = mSize - offset;
+    size_t partial = bytes % mFrameSize;
+
+    return partial ? bytes + mFrameSize - partial : bytes;
+}
+
+void ALSARingBuffer::advanceRead(size_t bytes)
+{
+    // Hand the space back only once the data has been copied out.
+    android_atomic_release_store(mFront + bytes, &mFront);
+}
+
+void ALSARingBuffer::reset()
+{
+    android_atomic_release_store(0, &mFront);
+    android_atomic_release_store(0, &mRear);
+}
+
+}       // namespace android
@@ -0,0 +1,417 @@
+/* ALSAStreamMixer.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+// SCHED_FIFO priority of the mixer thread, when it is allowed to have one.
+static const int MIXER_THREAD_PRIORITY = 2;
+
+// Saturating sum of 16 bit samples into dst.
+static void addS16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= samples; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+#elif defined(__SSE2__)
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        int32_t s = dst[i] + src[i];
+        dst[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+    }
+}
+
+// Other formats are summed as float and clipped on the way back.
+static void addFloat(float *dst, const float *src, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++)
+        dst[i] += src[i];
+}
+
+// ----------------------------------------------------------------------------
+
+ALSAStreamMixer::ALSAStreamMixer(alsa_handle_t *handle) :
+    Thread(false),
+    mHandle(handle),
+    mFrameSize(handle->channels * snd_pcm_format_physical_width(handle->format) / 8),
+    mToFloat(0),
+    mFromFloat(0),
+    mBuffer(0),
+    mTrackBuffer(0),
+    mFloatBuffer(0),
+    mFloatTrack(0),
+    mPeriodFrames(0),
+    mDelay(0),
+    mTime(0),
+    mPeriods(0),
+    mErrors(0)
+{
+    if (mHandle->format != SND_PCM_FORMAT_S16_LE) {
+        mToFloat = ALSAFormat::converter(mHandle->format,
+                SND_PCM_FORMAT_FLOAT_LE, mHandle->channels);
+        mFromFloat = ALSAFormat::converter(SND_PCM_FORMAT_FLOAT_LE,
+                mHandle->format, mHandle->channels);
+    }
+}
+
+ALSAStreamMixer::~ALSAStreamMixer()
+{
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it)
+        delete *it;
+
+    free(mBuffer);
+    free(mTrackBuffer);
+    free(mFloatBuffer);
+    free(mFloatTrack);
+}
+
+status_t ALSAStreamMixer::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = MIXER_THREAD_PRIORITY;
+
+    // Fall back to the urgent audio nice level given to run() when the
+    // process is not allowed to use real-time scheduling.
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+        LOGW("Unable to set SCHED_FIFO for the mixer thread: %s", strerror(err));
+
+    return NO_ERROR;
+}
+
+//
+// Each track gets a ring as long as the hardware buffer, so a stream can
+// run as far ahead of the mixer as it could of the PCM.
+//
+ALSAStreamMixer::Track *ALSAStreamMixer::addTrack()
+{
+    Track *track = new Track(mHandle->bufferSize * mFrameSize);
+
+    AutoMutex lock(mLock);
+    mTracks.push_back(track);
+
+    return track;
+}
+
+size_t ALSAStreamMixer::removeTrack(Track *track)
+{
+    AutoMutex lock(mLock);
+
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it)
+        if (*it == track) {
+            mTracks.erase(it);
+            delete track;
+            break;
+        }
+
+    mSpaceReady.broadcast();
+
+    return mTracks.size();
+}
+
+ssize_t ALSAStreamMixer::queue(Track *track, const void *buffer, size_t bytes)
+{
+    const char *src = static_cast<const char *>(buffer);
+    size_t queued = 0;
+
+    // Only whole frames go in, so the mixer never sees half of one.
+    bytes -= bytes % mFrameSize;
+
+    while (queued < bytes) {
+        size_t room = track->ring.availableToWrite();
+        room -= room % mFrameSize;
+        if (room > bytes - queued) room = bytes - queued;
+
+        size_t n = track->ring.write(src + queued, room);
+        queued += n;
+
+        AutoMutex lock(mLock);
+
+        if (n) mDataReady.signal();
+
+        if (queued < bytes && track->ring.availableToWrite() < mFrameSize) {
+            if (exitPending()) break;
+            mSpaceReady.wait(mLock);
+        }
+    }
+
+    return queued;
+}
+
+void ALSAStreamMixer::flush(Track *track)
+{
+    AutoMutex lock(mLock);
+
+    while (track->ring.availableToRead() && !exitPending())
+        mSpaceReady.wait(mLock);
+}
+
+status_t ALSAStreamMixer::position(Track *track, uint64_t *presented,
+                                   uint64_t *written, nsecs_t *time)
+{
+    AutoMutex lock(mLock);
+
+    if (!mTime) return INVALID_OPERATION;
+
+    // The delay covers every track, as they all went out together.
+    uint64_t delay = mDelay;
+    *presented = track->mixed > delay ? track->mixed - delay : 0;
+    *written = track->mixed;
+    *time = mTime;
+
+    return NO_ERROR;
+}
+
+status_t ALSAStreamMixer::route(uint32_t devices, int mode)
+{
+    AutoMutex lock(mPcmLock);
+
+    return mHandle->module->route(mHandle, devices, mode);
+}
+
+void ALSAStreamMixer::stop()
+{
+    requestExit();
+
+    {
+        AutoMutex lock(mLock);
+        mDataReady.signal();
+        mSpaceReady.broadcast();
+    }
+
+    requestExitAndWait();
+}
+
+//
+// Sum up to a period from every track into mBuffer. A track with less than
+// the others have to give is short of data, which counts as an underrun
+// for it. Returns the number of frames mixed. Called with mLock held.
+//
+size_t ALSAStreamMixer::mix(size_t frames)
+{
+    size_t avail = 0;
+
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it) {
+        size_t n = (*it)->ring.availableToRead() / mFrameSize;
+        if (n > avail) avail = n;
+    }
+
+    if (frames > avail) frames = avail;
+    if (!frames) return 0;
+
+    unsigned int channels = mHandle->channels;
+    size_t samples = frames * channels;
+
+    if (mToFloat)
+        memset(mFloatBuffer, 0, samples * sizeof(float));
+    else
+        memset(mBuffer, 0, frames * mFrameSize);
+
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it) {
+        Track *track = *it;
+        size_t n = track->ring.read(mTrackBuffer, frames * mFrameSize) / mFrameSize;
+
+        if (!n) continue;
+        if (n < frames) track->underruns++;
+
+        track->pending += n;
+
+        if (mToFloat) {
+            mToFloat(mTrackBuffer, mFloatTrack, n, channels);
+            addFloat(mFloatBuffer, mFloatTrack, n * channels);
+        } else
+            addS16(static_cast<int16_t *>(mBuffer),
+                   static_cast<const int16_t *>(mTrackBuffer), n * channels);
+    }
+
+    if (mFromFloat)
+        mFromFloat(mFloatBuffer, mBuffer, frames, channels);
+
+    return frames;
+}
+
+//
+// Send mixed frames to the PCM, recovering from errors on the way. Called
+// with mPcmLock held.
+//
+ssize_t ALSAStreamMixer::writePcm(const void *buffer, size_t frames)
+{
+    const char *data = static_cast<const char *>(buffer);
+    size_t sent = 0;
+
+    while (mHandle->handle && sent < frames) {
+        snd_pcm_sframes_t n;
+
+        if (mHandle->curAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+            n = snd_pcm_mmap_writei(mHandle->handle, data + sent * mFrameSize,
+                                    frames - sent);
+        else
+            n = snd_pcm_writei(mHandle->handle, data + sent * mFrameSize,
+                               frames - sent);
+
+        if (n == -EAGAIN)
+            continue;
+
+        if (n == -EBADFD) {
+            // See AudioStreamOutALSA::writePcm().
+            mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+            continue;
+        }
+
+        if (n < 0) {
+            n = snd_pcm_recover(mHandle->handle, n, 1);
+            if (n) return n;
+            continue;
+        }
+
+        sent += n;
+    }
+
+    return sent;
+}
+
+bool ALSAStreamMixer::threadLoop()
+{
+    snd_pcm_uframes_t bufferSize, periodSize = 0;
+
+    {
+        AutoMutex lock(mPcmLock);
+
+        if (mHandle->handle)
+            snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+    }
+
+    if (!periodSize)
+        periodSize = mHandle->bufferSize / (mHandle->periods ? mHandle->periods : 1);
+
+    if (periodSize != mPeriodFrames) {
+        size_t samples = periodSize * mHandle->channels;
+
+        free(mBuffer);
+        free(mTrackBuffer);
+        free(mFloatBuffer);
+        free(mFloatTrack);
+
+        mBuffer = malloc(periodSize * mFrameSize);
+        mTrackBuffer = malloc(periodSize * mFrameSize);
+        mFloatBuffer = static_cast<float *>(malloc(samples * sizeof(float)));
+        mFloatTrack = static_cast<float *>(malloc(samples * sizeof(float)));
+
+        if (!mBuffer || !mTrackBuffer || !mFloatBuffer || !mFloatTrack) {
+            LOGE("Unable to allocate mixer buffers for %lu frames", periodSize);
+            mPeriodFrames = 0;
+            return false;
+        }
+
+        mPeriodFrames = periodSize;
+    }
+
+    size_t frames;
+
+    {
+        AutoMutex lock(mLock);
+
+        frames = mix(mPeriodFrames);
+
+        // Wake up producers waiting for room, and anyone in flush().
+        mSpaceReady.broadcast();
+
+        if (!frames) {
+            if (!exitPending()) mDataReady.wait(mLock);
+            return true;
+        }
+    }
+
+    ssize_t n;
+    snd_pcm_sframes_t delay = 0;
+
+    {
+        AutoMutex lock(mPcmLock);
+
+        n = writePcm(mBuffer, frames);
+
+        if (!mHandle->handle || snd_pcm_delay(mHandle->handle, &delay) < 0 ||
+            delay < 0)
+            delay = 0;
+    }
+
+    AutoMutex lock(mLock);
+
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it) {
+        (*it)->mixed += (*it)->pending;
+        (*it)->pending = 0;
+    }
+
+    mDelay = delay;
+    mTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    mPeriods++;
+    if (n < 0) mErrors++;
+
+    return true;
+}
+
+void ALSAStreamMixer::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    AutoMutex lock(mLock);
+
+    snprintf(buffer, SIZE, "Mixer thread: %u tracks, %u periods of %u frames, %u write errors\n",
+            mTracks.size(), mPeriods, mPeriodFrames, mErrors);
+    result.append(buffer);
+
+    for (List<Track *>::iterator it = mTracks.begin(); it != mTracks.end(); ++it) {
+        snprintf(buffer, SIZE, "Mixer thread: track ring %u of %u bytes, %llu frames mixed, %u underruns\n",
+                (*it)->ring.availableToRead(), (*it)->ring.size(),
+                (*it)->mixed, (*it)->underruns);
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
+}
+
+}       // namespace android
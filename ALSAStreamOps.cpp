@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
@@ -36,20 +37,111 @@
 namespace android
 {
 
+static const char *profileKey = "output_profile";
+
+static const char *profileNames[] = {
+    "default",
+    "low_latency",
+    "deep_buffer",
+};
+
+#define PROFILE_COUNT (sizeof(profileNames) / sizeof(profileNames[0]))
+
+static const char *qualityKey = "resampler_quality";
+
+static const char *qualityNames[] = {
+    "low",
+    "medium",
+    "high",
+};
+
+#define QUALITY_COUNT (sizeof(qualityNames) / sizeof(qualityNames[0]))
+
+// Remix gains, row by row, one row per output channel.
+static const char *remixKey = "remix_matrix";
+
+static const unsigned int MAX_REMIX_CHANNELS = 8;
+
+// Client rates the resampler takes on.
+static const uint32_t MIN_SAMPLE_RATE = 4000;
+static const uint32_t MAX_SAMPLE_RATE = 192000;
+
+int ALSAStreamOps::profileIndex(const char *name)
+{
+    for (size_t i = 0; i < PROFILE_COUNT; i++)
+        if (!strcmp(name, profileNames[i])) return i;
+
+    return -1;
+}
+
+static int qualityIndex(const char *name)
+{
+    for (size_t i = 0; i < QUALITY_COUNT; i++)
+        if (!strcmp(name, qualityNames[i])) return i;
+
+    return -1;
+}
+
+// Parse comma separated gains, returning how many there were or -1.
+static int parseGains(const char *s, float *gains, size_t max)
+{
+    size_t count = 0;
+
+    while (*s) {
+        char *end;
+        double gain = strtod(s, &end);
+
+        if (end == s || count == max) return -1;
+        gains[count++] = gain;
+
+        s = end;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return -1;
+    }
+
+    return count;
+}
+
 // ----------------------------------------------------------------------------
 
 ALSAStreamOps::ALSAStreamOps(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     mParent(parent),
     mHandle(handle),
-    mPowerLock(false)
+    mPowerLock(false),
+    mSampleRate(0),
+    mFormat(SND_PCM_FORMAT_UNKNOWN),
+    mChannels(0),
+    mResamplerQuality(ALSAResampler::DEFAULT_QUALITY),
+    mBufferSize(0),
+    mPendingProfile(-1),
+    mResampler(0),
+    mRemixer(0),
+    mRamp(0)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.resampler.quality", value, "");
+    int quality = qualityIndex(value);
+    if (quality >= 0) mResamplerQuality = quality;
+
+    memset(mConvert, 0, sizeof(mConvert));
+    memset(mScratch, 0, sizeof(mScratch));
 }
 
 ALSAStreamOps::~ALSAStreamOps()
 {
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
 
     close();
+
+    delete mResampler;
+    delete mRemixer;
+
+    for (int i = 0; i < SCRATCH_COUNT; i++)
+        free(mScratch[i].data);
 }
 
 // use emulated popcount optimization
@@ -74,43 +166,261 @@ ALSAMixer *ALSAStreamOps::mixer()
     return mParent->mMixer;
 }
 
+size_t ALSAStreamOps::frameSize() const
+{
+    return mHandle->channels * snd_pcm_format_physical_width(mHandle->format) / 8;
+}
+
+snd_pcm_format_t ALSAStreamOps::clientFormat() const
+{
+    return mFormat != SND_PCM_FORMAT_UNKNOWN ? mFormat : mHandle->format;
+}
+
+unsigned int ALSAStreamOps::clientChannels() const
+{
+    return mChannels ? popCount(mChannels) : mHandle->channels;
+}
+
+size_t ALSAStreamOps::clientFrameSize() const
+{
+    return clientChannels() * snd_pcm_format_physical_width(clientFormat()) / 8;
+}
+
+//
+// The mask AudioSystem uses for a channel count. Counts without a layout of
+// their own take the positions in order.
+//
+static uint32_t channelMask(unsigned int count, bool output)
+{
+    if (output)
+        switch(count) {
+            case 1:
+                return AudioSystem::CHANNEL_OUT_MONO;
+            case 2:
+                return AudioSystem::CHANNEL_OUT_STEREO;
+            case 4:
+                return AudioSystem::CHANNEL_OUT_QUAD;
+            case 6:
+                return AudioSystem::CHANNEL_OUT_5POINT1;
+            case 8:
+                return AudioSystem::CHANNEL_OUT_7POINT1;
+            default:
+                return ((1 << count) - 1) * AudioSystem::CHANNEL_OUT_FRONT_LEFT;
+        }
+    else
+        switch(count) {
+            case 1:
+                return AudioSystem::CHANNEL_IN_LEFT;
+            case 2:
+                return AudioSystem::CHANNEL_IN_STEREO;
+            default:
+                return ((1 << count) - 1) * AudioSystem::CHANNEL_IN_LEFT;
+        }
+}
+
+void *ALSAStreamOps::scratch(int index, size_t bytes)
+{
+    scratch_t &buffer = mScratch[index];
+
+    if (bytes > buffer.size) {
+        void *data = realloc(buffer.data, bytes);
+        if (!data) return 0;
+
+        buffer.data = data;
+        buffer.size = bytes;
+    }
+
+    return buffer.data;
+}
+
+//
+// The resampler for the current client and hardware rates, built or rebuilt
+// as the handle, rate or quality changes. Returns 0 when no conversion is
+// needed.
+//
+ALSAResampler *ALSAStreamOps::resampler()
+{
+    bool output = mHandle->devices & AudioSystem::DEVICE_OUT_ALL;
+    uint32_t inRate = output ? mSampleRate : mHandle->sampleRate;
+    uint32_t outRate = output ? mHandle->sampleRate : mSampleRate;
+    bool needed = mSampleRate && mSampleRate != mHandle->sampleRate;
+
+    if (mResampler && (!needed ||
+                       mResampler->inRate() != inRate ||
+                       mResampler->outRate() != outRate ||
+                       mResampler->channels() != mHandle->channels ||
+                       mResampler->quality() != mResamplerQuality)) {
+        delete mResampler;
+        mResampler = 0;
+    }
+
+    if (needed && !mResampler)
+        mResampler = new ALSAResampler(inRate, outRate, mHandle->channels,
+                                       mResamplerQuality);
+
+    return mResampler;
+}
+
+//
+// The remixer from the client layout to the hardware one for output, and the
+// other way around for input. Rebuilt as either changes, which takes any
+// matrix set through setParameters() back to the default.
+//
+ALSARemixer *ALSAStreamOps::remixer()
+{
+    bool output = mHandle->devices & AudioSystem::DEVICE_OUT_ALL;
+    uint32_t client = mChannels;
+    uint32_t hardware = channelMask(mHandle->channels, output);
+
+    if (!output) {
+        client = ALSARemixer::inputLayout(client);
+        hardware = ALSARemixer::inputLayout(hardware);
+    }
+
+    uint32_t inMask = output ? client : hardware;
+    uint32_t outMask = output ? hardware : client;
+
+    if (mRemixer && (!mChannels ||
+                     mRemixer->inMask() != inMask ||
+                     mRemixer->outMask() != outMask)) {
+        delete mRemixer;
+        mRemixer = 0;
+    }
+
+    if (mChannels && !mRemixer)
+        mRemixer = new ALSARemixer(inMask, outMask,
+                output ? ALSARemixer::alsaOrder(hardware) : 0);
+
+    return mRemixer;
+}
+
+bool ALSAStreamOps::converting() const
+{
+    return (mSampleRate && mSampleRate != mHandle->sampleRate) ||
+           mFormat != SND_PCM_FORMAT_UNKNOWN || mChannels;
+}
+
+void ALSAStreamOps::selectConverters()
+{
+    bool output = mHandle->devices & AudioSystem::DEVICE_OUT_ALL;
+    snd_pcm_format_t from = output ? clientFormat() : mHandle->format;
+    snd_pcm_format_t to = output ? mHandle->format : clientFormat();
+    unsigned int fromChannels = output ? clientChannels() : mHandle->channels;
+    unsigned int toChannels = output ? mHandle->channels : clientChannels();
+
+    mConvert[CONVERT_DIRECT] = ALSAFormat::converter(from, to, fromChannels);
+    mConvert[CONVERT_TO_FLOAT] =
+            ALSAFormat::converter(from, SND_PCM_FORMAT_FLOAT_LE, fromChannels);
+    mConvert[CONVERT_FROM_FLOAT] =
+            ALSAFormat::converter(SND_PCM_FORMAT_FLOAT_LE, to, toChannels);
+    mRamp = ALSAFormat::ramper(mHandle->format);
+}
+
+//
+// Bring a client buffer to the hardware rate, format and channel layout,
+// going through float only when remixing or resampling. *data is left
+// pointing either at the caller's buffer or at scratch space, and the size
+// of what it points at is returned.
+//
+ssize_t ALSAStreamOps::convertOut(const void *buffer, size_t bytes,
+                                  const void **data)
+{
+    ALSAResampler *rs = resampler();
+    ALSARemixer *mix = remixer();
+
+    *data = buffer;
+    if (!rs && !mix && mFormat == SND_PCM_FORMAT_UNKNOWN) return bytes;
+    if (!mConvert[CONVERT_DIRECT]) return INVALID_OPERATION;
+
+    unsigned int channels = mHandle->channels;
+    size_t inFrames = bytes / clientFrameSize();
+    size_t outFrames = rs ? rs->outputFramesFor(inFrames) : inFrames;
+
+    void *pcm = scratch(SCRATCH_PCM, outFrames * frameSize());
+    if (!pcm) return NO_MEMORY;
+
+    if (!rs && !mix) {
+        mConvert[CONVERT_DIRECT](buffer, pcm, inFrames, channels);
+        *data = pcm;
+        return outFrames * frameSize();
+    }
+
+    float *in = static_cast<float *>(scratch(SCRATCH_FLOAT_IN,
+            inFrames * clientChannels() * sizeof(float)));
+    if (!in) return NO_MEMORY;
+
+    mConvert[CONVERT_TO_FLOAT](buffer, in, inFrames, clientChannels());
+
+    if (mix) {
+        float *out = static_cast<float *>(scratch(SCRATCH_FLOAT_MIX,
+                inFrames * channels * sizeof(float)));
+        if (!out) return NO_MEMORY;
+
+        mix->remix(in, out, inFrames);
+        in = out;
+    }
+
+    if (rs) {
+        float *out = static_cast<float *>(scratch(SCRATCH_FLOAT_OUT,
+                outFrames * channels * sizeof(float)));
+        if (!out) return NO_MEMORY;
+
+        rs->resample(in, &inFrames, out, &outFrames);
+        in = out;
+    }
+
+    mConvert[CONVERT_FROM_FLOAT](in, pcm, outFrames, channels);
+
+    *data = pcm;
+
+    return outFrames * frameSize();
+}
+
+void *ALSAStreamOps::mmapArea(const snd_pcm_channel_area_t *areas,
+                              snd_pcm_uframes_t offset)
+{
+    // Interleaved access keeps every channel in the first area, step bits
+    // apart per frame.
+    return static_cast<char *>(areas[0].addr) +
+           (areas[0].first + offset * areas[0].step) / 8;
+}
+
 status_t ALSAStreamOps::set(int      *format,
                             uint32_t *channels,
                             uint32_t *rate)
 {
+    bool output = mHandle->devices & AudioSystem::DEVICE_OUT_ALL;
+
     if (channels && *channels != 0) {
-        if (mHandle->channels != popCount(*channels))
+        // Other layouts are remixed here, as long as the hardware samples
+        // can be taken to float and back.
+        unsigned int count = popCount(*channels);
+        // ALSA interleaves 5.1 and 7.1 in another order than AudioSystem,
+        // so those go through the remixer even at the hardware's count.
+        bool reorder = output &&
+                ALSARemixer::alsaOrder(channelMask(count, output)) &&
+                ALSAFormat::supported(mHandle->format);
+
+        if (count == mHandle->channels && !reorder)
+            mChannels = 0;
+        else if (count <= MAX_REMIX_CHANNELS &&
+                 ALSAFormat::supported(mHandle->format))
+            mChannels = *channels;
+        else
             return BAD_VALUE;
     } else if (channels) {
-        *channels = 0;
-        if (mHandle->devices & AudioSystem::DEVICE_OUT_ALL)
-            switch(mHandle->channels) {
-                case 4:
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
-                    // Fall through...
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
-                    break;
-            }
-        else
-            switch(mHandle->channels) {
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_IN_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_IN_LEFT;
-                    break;
-            }
+        *channels = channelMask(mHandle->channels, output);
     }
 
     if (rate && *rate > 0) {
-        if (mHandle->sampleRate != *rate)
+        // Other rates are converted here rather than refused, as long as
+        // the hardware samples can be taken to float and back.
+        if (mHandle->sampleRate == *rate)
+            mSampleRate = 0;
+        else if (*rate >= MIN_SAMPLE_RATE && *rate <= MAX_SAMPLE_RATE &&
+                 ALSAFormat::supported(mHandle->format))
+            mSampleRate = *rate;
+        else
             return BAD_VALUE;
     } else if (rate)
         *rate = mHandle->sampleRate;
@@ -118,37 +428,30 @@ status_t ALSAStreamOps::set(int      *format,
     snd_pcm_format_t iformat = mHandle->format;
 
     if (format) {
-        switch(*format) {
-            case AudioSystem::FORMAT_DEFAULT:
-                break;
-
-            case AudioSystem::PCM_16_BIT:
-                iformat = SND_PCM_FORMAT_S16_LE;
-                break;
-
-            case AudioSystem::PCM_8_BIT:
-                iformat = SND_PCM_FORMAT_S8;
-                break;
+        if (*format != AudioSystem::FORMAT_DEFAULT) {
+            iformat = ALSAFormat::fromAudioSystem(*format);
 
-            default:
+            if (iformat == SND_PCM_FORMAT_UNKNOWN) {
                 LOGE("Unknown PCM format %i. Forcing default", *format);
-                break;
+                iformat = mHandle->format;
+            }
         }
 
-        if (mHandle->format != iformat)
+        // Other formats are converted here, as long as both ends are ones
+        // the converters know.
+        if (iformat == mHandle->format)
+            mFormat = SND_PCM_FORMAT_UNKNOWN;
+        else if (ALSAFormat::supported(iformat) &&
+                 ALSAFormat::supported(mHandle->format))
+            mFormat = iformat;
+        else
             return BAD_VALUE;
 
-        switch(iformat) {
-            default:
-            case SND_PCM_FORMAT_S16_LE:
-                *format = AudioSystem::PCM_16_BIT;
-                break;
-            case SND_PCM_FORMAT_S8:
-                *format = AudioSystem::PCM_8_BIT;
-                break;
-        }
+        *format = ALSAFormat::toAudioSystem(iformat);
     }
 
+    selectConverters();
+
     return NO_ERROR;
 }
 
@@ -162,7 +465,60 @@ status_t ALSAStreamOps::setParameters(const String8& keyValuePairs)
 
     if (param.getInt(key, device) == NO_ERROR) {
         AutoMutex lock(mLock);
-        mParent->mALSADevice->route(mHandle, (uint32_t)device, mParent->mode());
+        AutoMutex pcmLock(mPcmLock);
+        route((uint32_t)device, mParent->mode());
+        param.remove(key);
+    }
+
+    String8 value;
+    key = String8(profileKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        int profile = profileIndex(value.string());
+
+        if (profile >= 0) {
+            AutoMutex lock(mLock);
+            AutoMutex pcmLock(mPcmLock);
+            status = setProfile(profile);
+        } else
+            status = BAD_VALUE;
+
+        param.remove(key);
+    }
+
+    key = String8(qualityKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        int quality = qualityIndex(value.string());
+
+        if (quality >= 0) {
+            AutoMutex lock(mLock);
+            mResamplerQuality = quality;
+        } else
+            status = BAD_VALUE;
+
+        param.remove(key);
+    }
+
+    key = String8(remixKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        AutoMutex lock(mLock);
+        ALSARemixer *mix = remixer();
+        float gains[MAX_REMIX_CHANNELS * MAX_REMIX_CHANNELS];
+
+        if (!mix)
+            status = INVALID_OPERATION;
+        else if (!strcmp(value.string(), "default"))
+            mix->reset();
+        else {
+            int count = parseGains(value.string(), gains,
+                    MAX_REMIX_CHANNELS * MAX_REMIX_CHANNELS);
+
+            if (count < 0 || mix->setMatrix(gains, count) != NO_ERROR)
+                status = BAD_VALUE;
+        }
+
         param.remove(key);
     }
 
@@ -179,7 +535,39 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
     String8 key = String8(AudioParameter::keyRouting);
 
     if (param.get(key, value) == NO_ERROR) {
-        param.addInt(key, (int)mHandle->curDev);
+        AutoMutex lock(mLock);
+        param.addInt(key, (int)routedDevices());
+    }
+
+    key = String8(profileKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        if ((size_t)mHandle->profile < PROFILE_COUNT)
+            param.add(key, String8(profileNames[mHandle->profile]));
+    }
+
+    key = String8(qualityKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(qualityNames[mResamplerQuality]));
+    }
+
+    key = String8(remixKey);
+
+    if (param.get(key, value) == NO_ERROR) {
+        AutoMutex lock(mLock);
+        ALSARemixer *mix = remixer();
+
+        if (mix) {
+            const float *gains = mix->matrix();
+            size_t count = mix->outChannels() * mix->inChannels();
+            String8 matrix;
+
+            for (size_t i = 0; i < count; i++)
+                matrix.appendFormat(i ? ",%g" : "%g", gains[i]);
+
+            param.add(key, matrix);
+        }
     }
 
     LOGV("getParameters() %s", param.toString().string());
@@ -188,7 +576,7 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
 
 uint32_t ALSAStreamOps::sampleRate() const
 {
-    return mHandle->sampleRate;
+    return mSampleRate ? mSampleRate : mHandle->sampleRate;
 }
 
 //
@@ -196,12 +584,20 @@ uint32_t ALSAStreamOps::sampleRate() const
 //
 size_t ALSAStreamOps::bufferSize() const
 {
+    // AudioFlinger only reads this once, so it holds across profile switches.
+    if (mBufferSize) return mBufferSize;
+
     snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
     snd_pcm_uframes_t periodSize;
 
     snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
 
-    size_t bytes = static_cast<size_t>(snd_pcm_frames_to_bytes(mHandle->handle, bufferSize));
+    // The client sees the same time span at its own rate and format.
+    uint64_t frames = bufferSize;
+    if (mSampleRate)
+        frames = frames * mSampleRate / mHandle->sampleRate;
+
+    size_t bytes = static_cast<size_t>(frames * clientFrameSize());
 
     // Not sure when this happened, but unfortunately it now
     // appears that the bufferSize must be reported as a
@@ -214,63 +610,29 @@ size_t ALSAStreamOps::bufferSize() const
 
 int ALSAStreamOps::format() const
 {
-    int pcmFormatBitWidth;
-    int audioSystemFormat;
-
-    snd_pcm_format_t ALSAFormat = mHandle->format;
-
-    pcmFormatBitWidth = snd_pcm_format_physical_width(ALSAFormat);
-    switch(pcmFormatBitWidth) {
-        case 8:
-            audioSystemFormat = AudioSystem::PCM_8_BIT;
-            break;
-
-        default:
-            LOG_FATAL("Unknown AudioSystem bit width %i!", pcmFormatBitWidth);
-
-        case 16:
-            audioSystemFormat = AudioSystem::PCM_16_BIT;
-            break;
-    }
-
-    return audioSystemFormat;
+    return ALSAFormat::toAudioSystem(clientFormat());
 }
 
 uint32_t ALSAStreamOps::channels() const
 {
-    unsigned int count = mHandle->channels;
-    uint32_t channels = 0;
+    if (mChannels) return mChannels;
 
-    if (mHandle->curDev & AudioSystem::DEVICE_OUT_ALL)
-        switch(count) {
-            case 4:
-                channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
-                channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
-                // Fall through...
-            default:
-            case 2:
-                channels |= AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
-                // Fall through...
-            case 1:
-                channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
-                break;
-        }
-    else
-        switch(count) {
-            default:
-            case 2:
-                channels |= AudioSystem::CHANNEL_IN_RIGHT;
-                // Fall through...
-            case 1:
-                channels |= AudioSystem::CHANNEL_IN_LEFT;
-                break;
-        }
+    return channelMask(mHandle->channels,
+                       mHandle->curDev & AudioSystem::DEVICE_OUT_ALL);
+}
 
-    return channels;
+status_t ALSAStreamOps::route(uint32_t devices, int mode)
+{
+    return mParent->route(mHandle, devices, mode);
 }
 
 void ALSAStreamOps::close()
 {
+    // A PCM shared through a mixer or splitter stays open for the other
+    // streams.
+    if (mParent->streamMixer(mHandle) != 0 ||
+        mParent->streamSplitter(mHandle) != 0) return;
+
     mParent->mALSADevice->close(mHandle);
 }
 
@@ -286,7 +648,92 @@ void ALSAStreamOps::close()
 //
 status_t ALSAStreamOps::open(int mode)
 {
-    return mParent->mALSADevice->open(mHandle, mHandle->curDev, mode);
+    status_t err = mParent->mALSADevice->open(mHandle, mHandle->curDev, mode);
+
+    if (err == NO_ERROR) selectConverters();
+
+    return err;
+}
+
+//
+// Move the stream to the handle of another profile for the same devices.
+// Both handles may name the same PCM, so the current one is closed before the
+// new one is opened. That would cost whatever is still queued in it, so a
+// PCM with audio in flight is left alone and the switch made at the next
+// standby instead. The buffer size the client was given stays as it was.
+// Called with mLock and mPcmLock held.
+//
+status_t ALSAStreamOps::setProfile(int profile)
+{
+    // Asking for the current profile again also cancels a pending switch.
+    mPendingProfile = -1;
+
+    if (mHandle->profile == profile) return NO_ERROR;
+
+    // Other streams use the same PCM.
+    if (mParent->streamMixer(mHandle) != 0 ||
+        mParent->streamSplitter(mHandle) != 0) return INVALID_OPERATION;
+
+    uint32_t devices = mHandle->handle ? mHandle->curDev : mHandle->devices;
+    int mode = mHandle->handle ? mHandle->curMode : mParent->mode();
+
+    alsa_handle_t *handle = mParent->findHandle(devices, profile);
+    if (!handle) {
+        LOGW("No handle for profile %s on devices 0x%08x",
+                profileNames[profile], devices);
+        return BAD_VALUE;
+    }
+
+    if (!mBufferSize) mBufferSize = bufferSize();
+
+    if (!mHandle->handle) {
+        mHandle = handle;
+        selectConverters();
+        return NO_ERROR;
+    }
+
+    snd_pcm_sframes_t delay = 0;
+
+    switch (snd_pcm_state(mHandle->handle)) {
+    case SND_PCM_STATE_RUNNING:
+    case SND_PCM_STATE_DRAINING:
+    case SND_PCM_STATE_PAUSED:
+        delay = 1;
+        break;
+    case SND_PCM_STATE_PREPARED:
+        // Queued, but short of the start threshold.
+        if (snd_pcm_delay(mHandle->handle, &delay) < 0) delay = 0;
+        break;
+    default:
+        break;
+    }
+
+    if (delay > 0) {
+        LOGV("Switching to profile %s at the next standby", profileNames[profile]);
+        mPendingProfile = profile;
+        return NO_ERROR;
+    }
+
+    mParent->mALSADevice->close(mHandle);
+
+    status_t err = mParent->mALSADevice->open(handle, devices, mode);
+    if (err != NO_ERROR) {
+        LOGE("Unable to switch to profile %s: %d", profileNames[profile], err);
+        mParent->mALSADevice->open(mHandle, devices, mode);
+        return err;
+    }
+
+    mHandle = handle;
+    selectConverters();
+
+    return NO_ERROR;
+}
+
+status_t ALSAStreamOps::applyPendingProfile()
+{
+    if (mPendingProfile < 0) return NO_ERROR;
+
+    return setProfile(mPendingProfile);
 }
 
 }       // namespace android
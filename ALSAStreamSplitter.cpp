@@ -0,0 +1,405 @@
+/* ALSAStreamSplitter.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+// SCHED_FIFO priority of the capture thread, when it is allowed to have one.
+static const int SPLITTER_THREAD_PRIORITY = 2;
+
+// ----------------------------------------------------------------------------
+
+//
+// The ring holds twice the hardware buffer, the same slack a stream's own
+// reader thread gets, so a tap can be that late before it loses data. Any
+// history comes on top, allocated up front here.
+//
+ALSAStreamSplitter::ALSAStreamSplitter(alsa_handle_t *handle,
+                                       acoustic_device_t *acoustics,
+                                       uint32_t history) :
+    Thread(false),
+    mHandle(handle),
+    mAcoustics(acoustics),
+    mFrameSize(handle->channels * snd_pcm_format_physical_width(handle->format) / 8),
+    mHistory((uint64_t)history * handle->sampleRate / 1000 * mFrameSize),
+    mRing(0),
+    mSize(1),
+    mRear(0),
+    mPeriod(0),
+    mPeriodFrames(0),
+    mPeriods(0),
+    mErrors(0)
+{
+    while (mSize < mHistory + handle->bufferSize * mFrameSize * 2)
+        mSize <<= 1;
+
+    mRing = static_cast<char *>(malloc(mSize));
+    if (!mRing) {
+        LOGE("Unable to allocate %u byte capture ring", mSize);
+        mSize = 0;
+    }
+}
+
+ALSAStreamSplitter::~ALSAStreamSplitter()
+{
+    for (List<Tap *>::iterator it = mTaps.begin(); it != mTaps.end(); ++it)
+        delete *it;
+
+    free(mRing);
+    free(mPeriod);
+}
+
+status_t ALSAStreamSplitter::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = SPLITTER_THREAD_PRIORITY;
+
+    // Fall back to the urgent audio nice level given to run() when the
+    // process is not allowed to use real-time scheduling.
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+        LOGW("Unable to set SCHED_FIFO for the capture thread: %s", strerror(err));
+
+    return NO_ERROR;
+}
+
+ALSAStreamSplitter::Tap *ALSAStreamSplitter::addTap()
+{
+    Tap *tap = new Tap;
+
+    AutoMutex lock(mLock);
+    mTaps.push_back(tap);
+
+    return tap;
+}
+
+size_t ALSAStreamSplitter::removeTap(Tap *tap)
+{
+    AutoMutex lock(mLock);
+
+    for (List<Tap *>::iterator it = mTaps.begin(); it != mTaps.end(); ++it)
+        if (*it == tap) {
+            mTaps.erase(it);
+            delete tap;
+            break;
+        }
+
+    return mTaps.size();
+}
+
+// Whether anybody wants data, a history always does. Called with mLock held.
+bool ALSAStreamSplitter::active() const
+{
+    if (mHistory) return true;
+
+    for (List<Tap *>::const_iterator it = mTaps.begin(); it != mTaps.end(); ++it)
+        if ((*it)->active)
+            return true;
+
+    return false;
+}
+
+//
+// Bytes of the last msec still in the ring, in whole frames. Without a
+// history, no more than half the ring is given, so a tap starting that far
+// back is not overwritten before it catches up. Called with mLock held.
+//
+uint64_t ALSAStreamSplitter::backlog(uint32_t msec) const
+{
+    uint64_t bytes = (uint64_t)msec * mHandle->sampleRate / 1000 * mFrameSize;
+    uint64_t limit = mHistory ? mHistory : mSize / 2;
+
+    if (bytes > limit) bytes = limit;
+    if (bytes > mRear) bytes = mRear;
+
+    return bytes - bytes % mFrameSize;
+}
+
+//
+// A tap that falls a whole ring behind has been overwritten. It skips to
+// the oldest data still there, and the gap is counted as lost.
+//
+ssize_t ALSAStreamSplitter::dequeue(Tap *tap, void *buffer, size_t bytes,
+                                    nsecs_t timeout)
+{
+    char *dst = static_cast<char *>(buffer);
+    size_t done = 0;
+    nsecs_t deadline = systemTime() + timeout;
+
+    AutoMutex lock(mLock);
+
+    if (!tap->active) {
+        tap->active = true;
+        tap->cursor = mRear - backlog(tap->rewind);
+        mActive.signal();
+    }
+
+    for (;;) {
+        uint64_t avail = mRear - tap->cursor;
+
+        if (avail > mSize) {
+            tap->lost += (avail - mSize) / mFrameSize;
+            tap->overruns++;
+            tap->cursor = mRear - mSize;
+            avail = mSize;
+        }
+
+        size_t n = bytes - done;
+        if (n > avail) n = avail;
+
+        size_t offset = tap->cursor & (mSize - 1);
+        size_t part = mSize - offset;
+        if (part > n) part = n;
+
+        memcpy(dst + done, mRing + offset, part);
+        memcpy(dst + done + part, mRing, n - part);
+
+        tap->cursor += n;
+        done += n;
+
+        if (done == bytes || exitPending()) break;
+
+        nsecs_t remaining = deadline - systemTime();
+        if (remaining <= 0) break;
+
+        mDataReady.waitRelative(mLock, remaining);
+    }
+
+    return done;
+}
+
+void ALSAStreamSplitter::standby(Tap *tap)
+{
+    AutoMutex lock(mLock);
+
+    tap->active = false;
+}
+
+void ALSAStreamSplitter::rewind(Tap *tap, uint32_t msec)
+{
+    AutoMutex lock(mLock);
+
+    tap->rewind = msec;
+
+    if (tap->active)
+        tap->cursor = mRear - backlog(msec);
+}
+
+unsigned int ALSAStreamSplitter::takeLost(Tap *tap)
+{
+    AutoMutex lock(mLock);
+
+    unsigned int lost = tap->lost;
+    tap->lost = 0;
+
+    return lost;
+}
+
+status_t ALSAStreamSplitter::route(uint32_t devices, int mode)
+{
+    AutoMutex lock(mPcmLock);
+
+    return mHandle->module->route(mHandle, devices, mode);
+}
+
+void ALSAStreamSplitter::stop()
+{
+    requestExit();
+
+    {
+        AutoMutex lock(mLock);
+        mDataReady.broadcast();
+        mActive.signal();
+    }
+
+    requestExitAndWait();
+}
+
+//
+// Take frames from the PCM, recovering from errors on the way. Called with
+// mPcmLock held.
+//
+ssize_t ALSAStreamSplitter::readPcm(void *buffer, size_t frames)
+{
+    char *data = static_cast<char *>(buffer);
+    size_t got = 0;
+
+    while (mHandle->handle && got < frames) {
+        snd_pcm_t *pcm = mHandle->handle;
+        snd_pcm_sframes_t n;
+
+        // The stream is left in the SETUP state while nobody reads.
+        if (snd_pcm_state(pcm) == SND_PCM_STATE_SETUP &&
+            (n = snd_pcm_prepare(pcm)) < 0)
+            return got ? got : n;
+
+        if (mHandle->curAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+            // Nothing starts a memory mapped capture stream for us.
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+                snd_pcm_start(pcm);
+
+            n = snd_pcm_mmap_readi(pcm, data + got * mFrameSize, frames - got);
+        } else
+            n = snd_pcm_readi(pcm, data + got * mFrameSize, frames - got);
+
+        if (n == -EAGAIN)
+            continue;
+
+        if (n < 0) {
+            mErrors++;
+            n = snd_pcm_recover(pcm, n, 0);
+            if (n) return got ? got : n;
+            continue;
+        }
+
+        got += n;
+    }
+
+    return got;
+}
+
+//
+// Put captured data in the ring, through the acoustics module when it wants
+// to process it, so every tap gets the processed audio.
+//
+void ALSAStreamSplitter::store(char *dst, const char *src, size_t bytes)
+{
+    if (!bytes) return;
+
+    if (!mAcoustics ||
+        mAcoustics->common.version < ACOUSTICS_DEVICE_VERSION_PROCESS ||
+        !mAcoustics->process ||
+        mAcoustics->process(mAcoustics, src, dst, bytes) != NO_ERROR)
+        memcpy(dst, src, bytes);
+}
+
+bool ALSAStreamSplitter::threadLoop()
+{
+    bool idle;
+
+    {
+        AutoMutex lock(mLock);
+        idle = !active();
+    }
+
+    if (idle) {
+        // Nobody is reading, so stop capturing until somebody does.
+        {
+            AutoMutex lock(mPcmLock);
+            if (mHandle->handle) snd_pcm_drop(mHandle->handle);
+        }
+
+        AutoMutex lock(mLock);
+
+        while (!active() && !exitPending())
+            mActive.wait(mLock);
+
+        return true;
+    }
+
+    snd_pcm_uframes_t bufferSize, periodSize = 0;
+    ssize_t n = 0;
+
+    {
+        AutoMutex lock(mPcmLock);
+
+        if (mHandle->handle)
+            snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+
+        if (!periodSize)
+            periodSize = mHandle->bufferSize / (mHandle->periods ? mHandle->periods : 1);
+
+        if (periodSize != mPeriodFrames) {
+            free(mPeriod);
+            mPeriod = malloc(periodSize * mFrameSize);
+            mPeriodFrames = mPeriod ? periodSize : 0;
+        }
+
+        if (mPeriodFrames && mSize)
+            n = readPcm(mPeriod, mPeriodFrames);
+    }
+
+    if (n <= 0) {
+        // Closed underneath us, or an unrecoverable error. Do not spin.
+        usleep(10000);
+        return true;
+    }
+
+    size_t bytes = n * mFrameSize;
+    const char *src = static_cast<const char *>(mPeriod);
+
+    AutoMutex lock(mLock);
+
+    size_t offset = mRear & (mSize - 1);
+    size_t part = mSize - offset;
+    if (part > bytes) part = bytes;
+
+    store(mRing + offset, src, part);
+    store(mRing, src + part, bytes - part);
+
+    mRear += bytes;
+    mPeriods++;
+
+    mDataReady.broadcast();
+
+    return true;
+}
+
+void ALSAStreamSplitter::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    AutoMutex lock(mLock);
+
+    snprintf(buffer, SIZE, "Capture thread: %u taps, %u periods of %u frames, %u read errors\n",
+            mTaps.size(), mPeriods, mPeriodFrames, mErrors);
+    result.append(buffer);
+
+    if (mHistory) {
+        snprintf(buffer, SIZE, "Capture thread: %u bytes of history kept\n", mHistory);
+        result.append(buffer);
+    }
+
+    for (List<Tap *>::iterator it = mTaps.begin(); it != mTaps.end(); ++it) {
+        uint64_t behind = mRear - (*it)->cursor;
+
+        snprintf(buffer, SIZE, "Capture thread: tap %s, %llu of %u bytes behind, %u overruns\n",
+                (*it)->active ? "active" : "in standby", behind, mSize,
+                (*it)->overruns);
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
+}
+
+}       // namespace android
@@ -20,7 +20,14 @@ ifeq ($(strip $(BOARD_USES_ALSA_AUDIO)),true)
 	AudioStreamInALSA.cpp \
 	ALSAStreamOps.cpp \
 	ALSAMixer.cpp \
-	ALSAControl.cpp
+	ALSAControl.cpp \
+	ALSARingBuffer.cpp \
+	ALSAResampler.cpp \
+	ALSAFormat.cpp \
+	ALSARemixer.cpp \
+	ALSAStreamMixer.cpp \
+	ALSAFanOut.cpp \
+	ALSAStreamSplitter.cpp
 
   LOCAL_MODULE := libaudio
 
@@ -41,6 +48,40 @@ endif
 
   include $(BUILD_SHARED_LIBRARY)
 
+# Host tool checking and timing the format and resampler kernels
+
+ifeq ($(HOST_OS),linux)
+
+  include $(CLEAR_VARS)
+
+  LOCAL_CFLAGS := -D_POSIX_SOURCE
+
+ifeq ($(HOST_ARCH),x86)
+  LOCAL_CFLAGS += -msse2
+endif
+
+  LOCAL_C_INCLUDES += external/alsa-lib/include
+
+  LOCAL_SRC_FILES := \
+	alsa_benchmark.cpp \
+	ALSAResampler.cpp \
+	ALSAFormat.cpp
+
+  LOCAL_MODULE := alsa_benchmark
+
+  LOCAL_STATIC_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog
+
+  LOCAL_LDLIBS += -lasound -lpthread -lrt -lm
+
+  LOCAL_MODULE_TAGS := optional
+
+  include $(BUILD_HOST_EXECUTABLE)
+
+endif
+
 # This is the ALSA audio policy manager
 
   include $(CLEAR_VARS)
@@ -78,6 +119,14 @@ ifneq ($(ALSA_DEFAULT_SAMPLE_RATE),)
     LOCAL_CFLAGS += -DALSA_DEFAULT_SAMPLE_RATE=$(ALSA_DEFAULT_SAMPLE_RATE)
 endif
 
+ifneq ($(ALSA_PCM_POOL_SIZE),)
+    LOCAL_CFLAGS += -DALSA_PCM_POOL_SIZE=$(ALSA_PCM_POOL_SIZE)
+endif
+
+ifneq ($(ALSA_PCM_POOL_IDLE_MS),)
+    LOCAL_CFLAGS += -DALSA_PCM_POOL_IDLE_MS=$(ALSA_PCM_POOL_IDLE_MS)
+endif
+
   LOCAL_C_INCLUDES += external/alsa-lib/include
 
   LOCAL_SRC_FILES:= alsa_default.cpp
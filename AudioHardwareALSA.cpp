@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
@@ -67,14 +68,72 @@ static void ALSAErrorHandler(const char *file,
     va_end(arg);
 }
 
+// The handle as modules older than ALSA_DEVICE_VERSION_PROFILES know it. Their
+// init fills a list of these, which is then copied into full handles.
+struct alsa_handle_v0_t {
+    alsa_device_t *     module;
+    uint32_t            devices;
+    uint32_t            curDev;
+    int                 curMode;
+    snd_pcm_t *         handle;
+    snd_pcm_format_t    format;
+    uint32_t            channels;
+    uint32_t            sampleRate;
+    unsigned int        latency;
+    unsigned int        bufferSize;
+    void *              modPrivate;
+};
+
+static void initDeviceList(alsa_device_t *device, ALSAHandleList &list)
+{
+    if (device->common.version >= ALSA_DEVICE_VERSION_PROFILES) {
+        device->init(device, list);
+        return;
+    }
+
+    List<alsa_handle_v0_t> oldList;
+    device->init(device, reinterpret_cast<ALSAHandleList &>(oldList));
+
+    for (List<alsa_handle_v0_t>::iterator it = oldList.begin();
+        it != oldList.end(); ++it) {
+        alsa_handle_t handle;
+        memset(&handle, 0, sizeof(handle));
+        memcpy(&handle, &(*it), sizeof(alsa_handle_v0_t));
+        handle.access = SND_PCM_ACCESS_RW_INTERLEAVED;
+        handle.curAccess = SND_PCM_ACCESS_RW_INTERLEAVED;
+        handle.profile = ALSA_PROFILE_DEFAULT;
+        list.push_back(handle);
+    }
+}
+
 AudioHardwareInterface *AudioHardwareALSA::create() {
     return new AudioHardwareALSA();
 }
 
 AudioHardwareALSA::AudioHardwareALSA() :
     mALSADevice(0),
-    mAcousticDevice(0)
+    mAcousticDevice(0),
+    mOutputProfile(ALSA_PROFILE_DEFAULT),
+    mMixOutputs(false),
+    mShareInputs(false)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.playback.mixer", value, "0");
+    mMixOutputs = atoi(value) || !strcmp(value, "true");
+
+    property_get("alsa.capture.splitter", value, "0");
+    mShareInputs = atoi(value) || !strcmp(value, "true");
+
+    // AudioFlinger sizes its buffers from the stream it opens, so a profile
+    // only helps if the output starts out on it.
+    property_get("alsa.playback.profile", value, "default");
+    int profile = ALSAStreamOps::profileIndex(value);
+    if (profile >= 0)
+        mOutputProfile = profile;
+    else
+        LOGW("Unknown output profile %s, using the default", value);
+
     snd_lib_error_set_handler(&ALSAErrorHandler);
     mMixer = new ALSAMixer;
 
@@ -87,7 +146,7 @@ AudioHardwareALSA::AudioHardwareALSA() :
         err = module->methods->open(module, ALSA_HARDWARE_NAME, &device);
         if (err == 0) {
             mALSADevice = (alsa_device_t *)device;
-            mALSADevice->init(mALSADevice, mDeviceList);
+            initDeviceList(mALSADevice, mDeviceList);
         } else
             LOGE("ALSA Module could not be opened!!!");
     } else
@@ -104,10 +163,24 @@ AudioHardwareALSA::AudioHardwareALSA() :
         else
             LOGE("Acoustics Module not found.");
     }
+
+    property_get("alsa.capture.history_ms", value, "0");
+    uint32_t history = strtoul(value, 0, 0);
+
+    if (history && mALSADevice) startCaptureHistory(history);
 }
 
 AudioHardwareALSA::~AudioHardwareALSA()
 {
+    // Only a history outlives its streams.
+    for (List< sp<ALSAStreamSplitter> >::iterator it = mStreamSplitters.begin();
+         it != mStreamSplitters.end(); ++it) {
+        (*it)->stop();
+        mALSADevice->close((*it)->handle());
+    }
+
+    mStreamSplitters.clear();
+
     if (mMixer) delete mMixer;
     if (mALSADevice)
         mALSADevice->common.close(&mALSADevice->common);
@@ -121,21 +194,29 @@ status_t AudioHardwareALSA::initCheck()
         return NO_INIT;
 
     if (!mMixer || !mMixer->isValid())
-        LOGW("ALSA Mixer is not valid. AudioFlinger will do software volume control.");
+        LOGW("ALSA Mixer is not valid. Stream volume will be applied in software.");
 
     return NO_ERROR;
 }
 
 status_t AudioHardwareALSA::setVoiceVolume(float volume)
 {
-    // The voice volume is used by the VOICE_CALL audio stream.
-    if (mOutStream) {
-        // the mOutStream will set the volume of current device
-        return mOutStream->setVolume(volume, volume);
-    } else {
-        // return error
+    // The voice volume is used by the VOICE_CALL audio stream. It goes to
+    // the mixer for the devices currently routed for playback and never
+    // into a stream's software gain, which is only for stream volume.
+    uint32_t devices = 0;
+
+    if (!mMixer)
         return INVALID_OPERATION;
-    }
+
+    for(ALSAHandleList::iterator it = mDeviceList.begin();
+        it != mDeviceList.end(); ++it)
+        devices |= it->curDev & AudioSystem::DEVICE_OUT_ALL;
+
+    if (!devices)
+        return INVALID_OPERATION;
+
+    return mMixer->setVolume(devices, volume, volume);
 }
 
 status_t AudioHardwareALSA::setMasterVolume(float volume)
@@ -158,7 +239,7 @@ status_t AudioHardwareALSA::setMode(int mode)
             for(ALSAHandleList::iterator it = mDeviceList.begin();
                 it != mDeviceList.end(); ++it)
                 if (it->curDev) {
-                    status = mALSADevice->route(&(*it), it->curDev, mode);
+                    status = route(&(*it), it->curDev, mode);
                     if (status != NO_ERROR)
                         break;
                 }
@@ -179,21 +260,77 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
 
     status_t err = BAD_VALUE;
     AudioStreamOutALSA *out = 0;
-
-    if (devices & (devices - 1)) {
-        if (status) *status = err;
-        LOGD("openOutputStream called with bad devices");
-        return out;
-    }
+    bool several = devices & (devices - 1);
+    int profile = findHandle(devices, mOutputProfile) ? mOutputProfile :
+                                                        ALSA_PROFILE_DEFAULT;
 
     // Find the appropriate alsa device
     for(ALSAHandleList::iterator it = mDeviceList.begin();
         it != mDeviceList.end(); ++it)
-        if (it->devices & devices) {
-            err = mALSADevice->open(&(*it), devices, mode());
-            if (err) break;
-            out = new AudioStreamOutALSA(this, &(*it));
-            err = out->set(format, channels, sampleRate);
+        if ((it->devices & devices) && it->profile == profile) {
+            alsa_handle_t *handle = &(*it);
+            sp<ALSAStreamMixer> mixer;
+            ALSAStreamMixer::Track *track = 0;
+
+            if (mMixOutputs) {
+                AutoMutex lock(mStreamMixersLock);
+
+                // Streams after the first on a handle join the mixer playing
+                // through its PCM rather than reopening it. The track goes
+                // on under the lock the last stream leaves it by. They all
+                // share one route, which a newcomer may not change under
+                // the others.
+                mixer = streamMixer_l(handle);
+                if (mixer != 0) {
+                    if (handle->curDev != devices) {
+                        LOGE("Output on devices 0x%08x can't join the one "
+                             "mixed on 0x%08x", devices, handle->curDev);
+                        err = INVALID_OPERATION;
+                        break;
+                    }
+
+                    track = mixer->addTrack();
+                }
+            }
+
+            // Otherwise the PCM is opened on the first device, and a stream
+            // for several is copied to the others once it exists. A PCM
+            // still open here belongs to a stream playing without a mixer,
+            // or to the last one leaving a mixer, and reopening it would
+            // pull it out from under that stream.
+            if (mixer == 0) {
+                if (handle->handle) {
+                    LOGE("Devices 0x%08x are in use by another output", devices);
+                    err = INVALID_OPERATION;
+                    break;
+                }
+
+                err = mALSADevice->open(handle, devices & -devices, mode());
+                if (err) break;
+            }
+
+            if (mMixOutputs && mixer == 0 && !several &&
+                ALSAFormat::supported(handle->format)) {
+                mixer = new ALSAStreamMixer(handle);
+
+                if (mixer->run("ALSAMixer", PRIORITY_URGENT_AUDIO) == NO_ERROR) {
+                    AutoMutex lock(mStreamMixersLock);
+                    track = mixer->addTrack();
+                    mStreamMixers.push_back(mixer);
+                } else {
+                    LOGE("Unable to start the mixer thread, playing directly");
+                    mixer.clear();
+                }
+            }
+
+            out = new AudioStreamOutALSA(this, handle);
+            if (mixer != 0)
+                out->setStreamMixer(mixer, track);
+            else if (several)
+                err = out->setDevices(devices);
+
+            if (err == NO_ERROR)
+                err = out->set(format, channels, sampleRate);
             break;
         }
 
@@ -226,10 +363,37 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
     // Find the appropriate alsa device
     for(ALSAHandleList::iterator it = mDeviceList.begin();
         it != mDeviceList.end(); ++it)
-        if (it->devices & devices) {
-            err = mALSADevice->open(&(*it), devices, mode());
+        if ((it->devices & devices) && it->profile == ALSA_PROFILE_DEFAULT) {
+            alsa_handle_t *handle = &(*it);
+            sp<ALSAStreamSplitter> splitter;
+
+            // Streams after the first on a handle take their data from the
+            // splitter capturing from its PCM rather than reopening it.
+            if (mShareInputs) splitter = streamSplitter(handle);
+
+            if (splitter != 0)
+                err = handle->curDev == devices ? (status_t)NO_ERROR :
+                      splitter->route(devices, mode());
+            else
+                err = mALSADevice->open(handle, devices, mode());
+
             if (err) break;
-            in = new AudioStreamInALSA(this, &(*it), acoustics);
+
+            if (mShareInputs && splitter == 0) {
+                splitter = new ALSAStreamSplitter(handle, mAcousticDevice, 0);
+
+                if (splitter->run("ALSASplitter", PRIORITY_URGENT_AUDIO) == NO_ERROR) {
+                    AutoMutex lock(mStreamSplittersLock);
+                    mStreamSplitters.push_back(splitter);
+                } else {
+                    LOGE("Unable to start the capture thread, reading directly");
+                    splitter.clear();
+                }
+            }
+
+            in = new AudioStreamInALSA(this, handle, acoustics);
+            if (splitter != 0) in->setStreamSplitter(splitter);
+
             err = in->set(format, channels, sampleRate);
             break;
         }
@@ -260,6 +424,143 @@ status_t AudioHardwareALSA::getMicMute(bool *state)
     return NO_ERROR;
 }
 
+alsa_handle_t *
+AudioHardwareALSA::findHandle(uint32_t devices, int profile)
+{
+    for(ALSAHandleList::iterator it = mDeviceList.begin();
+        it != mDeviceList.end(); ++it)
+        if ((it->devices & devices) && it->profile == profile)
+            return &(*it);
+
+    return 0;
+}
+
+sp<ALSAStreamMixer> AudioHardwareALSA::streamMixer(alsa_handle_t *handle)
+{
+    AutoMutex lock(mStreamMixersLock);
+
+    return streamMixer_l(handle);
+}
+
+sp<ALSAStreamMixer> AudioHardwareALSA::streamMixer_l(alsa_handle_t *handle)
+{
+    for (List< sp<ALSAStreamMixer> >::iterator it = mStreamMixers.begin();
+         it != mStreamMixers.end(); ++it)
+        if ((*it)->handle() == handle)
+            return *it;
+
+    return 0;
+}
+
+//
+// Take a stream's track off its mixer, returning how many are left. The last
+// one out takes the mixer off the list in the same step, so that no new
+// stream can join it, and stops it. That stream then closes the PCM itself.
+//
+size_t AudioHardwareALSA::leaveStreamMixer(const sp<ALSAStreamMixer> &mixer,
+                                           ALSAStreamMixer::Track *track)
+{
+    size_t remaining;
+
+    {
+        AutoMutex lock(mStreamMixersLock);
+
+        remaining = mixer->removeTrack(track);
+        if (!remaining)
+            for (List< sp<ALSAStreamMixer> >::iterator it = mStreamMixers.begin();
+                 it != mStreamMixers.end(); ++it)
+                if (*it == mixer) {
+                    mStreamMixers.erase(it);
+                    break;
+                }
+    }
+
+    if (!remaining) mixer->stop();
+
+    return remaining;
+}
+
+sp<ALSAStreamSplitter> AudioHardwareALSA::streamSplitter(alsa_handle_t *handle)
+{
+    AutoMutex lock(mStreamSplittersLock);
+
+    for (List< sp<ALSAStreamSplitter> >::iterator it = mStreamSplitters.begin();
+         it != mStreamSplitters.end(); ++it)
+        if ((*it)->handle() == handle)
+            return *it;
+
+    return 0;
+}
+
+// Called by the last input stream leaving a splitter, which closes the PCM
+// itself once the splitter has stopped.
+void AudioHardwareALSA::releaseStreamSplitter(const sp<ALSAStreamSplitter> &splitter)
+{
+    splitter->stop();
+
+    AutoMutex lock(mStreamSplittersLock);
+
+    for (List< sp<ALSAStreamSplitter> >::iterator it = mStreamSplitters.begin();
+         it != mStreamSplitters.end(); ++it)
+        if (*it == splitter) {
+            mStreamSplitters.erase(it);
+            break;
+        }
+}
+
+//
+// Keep the built in microphone capturing into the last msec of a splitter
+// from the start, even while nobody reads, so that an input stream opened
+// later can begin with what was said before it was. Every input stream on
+// the handle shares the PCM from then on.
+//
+void AudioHardwareALSA::startCaptureHistory(uint32_t msec)
+{
+    uint32_t device = AudioSystem::DEVICE_IN_BUILTIN_MIC;
+    alsa_handle_t *handle = findHandle(device, ALSA_PROFILE_DEFAULT);
+
+    if (!handle || mALSADevice->open(handle, device, mode()) != NO_ERROR) {
+        LOGE("Unable to open the microphone for a capture history");
+        return;
+    }
+
+    if (mAcousticDevice) mAcousticDevice->use_handle(mAcousticDevice, handle);
+
+    sp<ALSAStreamSplitter> splitter =
+            new ALSAStreamSplitter(handle, mAcousticDevice, msec);
+
+    if (splitter->run("ALSAHistory", PRIORITY_URGENT_AUDIO) != NO_ERROR) {
+        LOGE("Unable to start the capture history thread");
+        mALSADevice->close(handle);
+        return;
+    }
+
+    AutoMutex lock(mStreamSplittersLock);
+    mStreamSplitters.push_back(splitter);
+
+    mShareInputs = true;
+
+    LOGI("Keeping %u ms of capture history", msec);
+}
+
+//
+// Route a handle, keeping any mixer or splitter sharing it off the PCM
+// meanwhile.
+//
+status_t AudioHardwareALSA::route(alsa_handle_t *handle, uint32_t devices, int mode)
+{
+    sp<ALSAStreamMixer> mixer = streamMixer(handle);
+    sp<ALSAStreamSplitter> splitter = streamSplitter(handle);
+
+    if (mixer != 0)
+        return mixer->route(devices, mode);
+
+    if (splitter != 0)
+        return splitter->route(devices, mode);
+
+    return mALSADevice->route(handle, devices, mode);
+}
+
 status_t AudioHardwareALSA::dump(int fd, const Vector<String16>& args)
 {
     return NO_ERROR;
@@ -18,7 +18,11 @@
 #ifndef ANDROID_AUDIO_HARDWARE_ALSA_H
 #define ANDROID_AUDIO_HARDWARE_ALSA_H
 
+#include <utils/KeyedVector.h>
 #include <utils/List.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
 #include <hardware_legacy/AudioHardwareBase.h>
 
 #include <alsa/asoundlib.h>
@@ -36,6 +40,32 @@ class AudioHardwareALSA;
 #define ALSA_HARDWARE_MODULE_ID "alsa"
 #define ALSA_HARDWARE_NAME      "alsa"
 
+/**
+ * Output profiles. Handles covering the same devices are told apart by
+ * their profile, and a stream can be moved between them.
+ */
+enum {
+    ALSA_PROFILE_DEFAULT = 0,
+    ALSA_PROFILE_LOW_LATENCY,
+    ALSA_PROFILE_DEEP_BUFFER,
+};
+
+/**
+ * PCM formats streams accept beyond the ones AudioSystem knows about. The
+ * values are the ones later AudioSystem revisions give these formats.
+ */
+enum {
+    ALSA_PCM_SUB_32_BIT         = 0x3,  // Signed 32 bit
+    ALSA_PCM_SUB_8_24_BIT       = 0x4,  // Signed 24 bit in 32, low aligned
+    ALSA_PCM_SUB_FLOAT          = 0x5,  // Single precision float
+    ALSA_PCM_SUB_24_BIT_PACKED  = 0x6,  // Signed 24 bit in three bytes
+
+    ALSA_PCM_32_BIT         = AudioSystem::PCM | ALSA_PCM_SUB_32_BIT,
+    ALSA_PCM_8_24_BIT       = AudioSystem::PCM | ALSA_PCM_SUB_8_24_BIT,
+    ALSA_PCM_FLOAT          = AudioSystem::PCM | ALSA_PCM_SUB_FLOAT,
+    ALSA_PCM_24_BIT_PACKED  = AudioSystem::PCM | ALSA_PCM_SUB_24_BIT_PACKED,
+};
+
 struct alsa_device_t;
 
 struct alsa_handle_t {
@@ -50,6 +80,17 @@ struct alsa_handle_t {
     unsigned int        latency;         // Delay in usec
     unsigned int        bufferSize;      // Size of sample buffer
     void *              modPrivate;
+
+    // Only in handles from modules of ALSA_DEVICE_VERSION_PROFILES on.
+    // Those of older modules are copied over with defaults by the HAL.
+    unsigned int        periods;         // Number of periods in the buffer
+    unsigned int        startThreshold;  // Requested frames queued before playback starts
+    unsigned int        availMin;        // Requested frames available before waking up
+    unsigned int        curStartThreshold; // Start threshold in use
+    unsigned int        curAvailMin;     // Available minimum in use
+    snd_pcm_access_t    access;          // Requested transfer method
+    snd_pcm_access_t    curAccess;       // Transfer method in use
+    int                 profile;
 };
 
 typedef List<alsa_handle_t> ALSAHandleList;
@@ -63,12 +104,23 @@ struct alsa_device_t {
     status_t (*route)(alsa_handle_t *, uint32_t, int);
 };
 
+/**
+ * First ALSA device version (common.version) whose handles have the fields
+ * after modPrivate
+ */
+#define ALSA_DEVICE_VERSION_PROFILES    1
+
 /**
  * The id of acoustics module
  */
 #define ACOUSTICS_HARDWARE_MODULE_ID    "acoustics"
 #define ACOUSTICS_HARDWARE_NAME         "acoustics"
 
+/**
+ * First acoustics device version (common.version) that has process()
+ */
+#define ACOUSTICS_DEVICE_VERSION_PROCESS 1
+
 struct acoustic_device_t {
     hw_device_t common;
 
@@ -84,10 +136,18 @@ struct acoustic_device_t {
     status_t (*recover)(acoustic_device_t *, int);
 
     void *              modPrivate;
+
+    // Optional for memory mapped capture: process audio straight out of the
+    // DMA area (first buffer) into the caller's buffer (second buffer).
+    // Only there from ACOUSTICS_DEVICE_VERSION_PROCESS on, so that modules
+    // built against the older layout still line up.
+    status_t (*process)(acoustic_device_t *, const void *, void *, size_t);
 };
 
 // ----------------------------------------------------------------------------
 
+struct mixer_info_t;
+
 class ALSAMixer
 {
 public:
@@ -107,7 +167,61 @@ public:
     status_t                getPlaybackMuteState(uint32_t device, bool *state);
 
 private:
+    //
+    // Simple elements by name, one table per mixer, kept up to date from
+    // the mixer's element events along with the elements bound to devices.
+    //
+    enum { INDEX_SIZE = 256 };              // Buckets, a power of two
+
+    struct IndexEntry {
+        ALSAMixer *         owner;
+        int                 stream;
+        snd_mixer_elem_t *  elem;
+        uint32_t            hash;
+        IndexEntry *        next;
+    };
+
+    void                    addElement(int stream, snd_mixer_elem_t *elem);
+    void                    removeElement(IndexEntry *entry);
+    snd_mixer_elem_t *      findElement(int stream, const char *name) const;
+    void                    bind(int stream, mixer_info_t *info);
+    void                    rebind(int stream);
+    void                    handleEvents();
+
+    static int              mixerEvent(snd_mixer_t *mixer, unsigned int mask,
+                                       snd_mixer_elem_t *elem);
+    static int              elementEvent(snd_mixer_elem_t *elem, unsigned int mask);
+
+    //
+    // Volume steps are written from a thread of their own, so the caller
+    // does not wait on a control write per slider move. Only the latest
+    // step of each element is written.
+    //
+    class VolumeWriter : public Thread
+    {
+    public:
+        VolumeWriter(ALSAMixer *mixer) : Thread(false), mMixer(mixer) {}
+
+    private:
+        virtual bool        threadLoop() { return mMixer->writeVolumes(); }
+
+        ALSAMixer *         mMixer;
+    };
+
+    friend class VolumeWriter;
+
+    void                    queueVolume(mixer_info_t *info, float level);
+    bool                    writeVolumes();
+    void                    flushVolumes();
+
     snd_mixer_t *           mMixer[SND_PCM_STREAM_LAST+1];
+    IndexEntry *            mIndex[SND_PCM_STREAM_LAST+1][INDEX_SIZE];
+
+    Mutex                   mLock;          // Everything touching the mixers
+    Condition               mVolumeQueued;
+    bool                    mQueued;
+    bool                    mStopping;
+    sp<VolumeWriter>        mWriter;
 };
 
 class ALSAControl
@@ -116,13 +230,218 @@ public:
     ALSAControl(const char *device = "hw:00");
     virtual                ~ALSAControl();
 
+    // One control of a batch. An index of -1 sets every value it has.
+    struct Setting {
+        const char *        name;
+        unsigned int        value;
+        int                 index;
+    };
+
     status_t                get(const char *name, unsigned int &value, int index = 0);
     status_t                set(const char *name, unsigned int value, int index = -1);
 
     status_t                set(const char *name, const char *);
 
+    // Write each control in turn, going on past failures. The first error
+    // is returned.
+    status_t                set(const Setting *settings, size_t count);
+
 private:
+    //
+    // What is needed to address a control and fill in its value, cached by
+    // name after the first lookup. Element events drop entries whose
+    // element changed or went away.
+    //
+    struct Element {
+        unsigned int        numid;
+        snd_ctl_elem_type_t type;
+        int                 count;
+        int                 items;
+    };
+
+    status_t                lookup(const char *name, Element &element);
+    status_t                write(const char *name, const Element &element,
+                                  snd_ctl_elem_value_t *control,
+                                  unsigned int value, int index);
+    void                    handleEvents();
+
     snd_ctl_t *             mHandle;
+
+    Mutex                   mLock;
+    bool                    mCaching;       // Only with events to go by
+    KeyedVector<String8, Element> mElements;
+};
+
+//
+// Lock-free single producer, single consumer byte ring.
+//
+class ALSARingBuffer
+{
+public:
+    // Regions only ever hold whole frames of frameSize bytes. A frame that
+    // wraps around the end is kept whole in a guard area past it.
+    ALSARingBuffer(size_t size, size_t frameSize = 1);
+    virtual                ~ALSARingBuffer();
+
+    size_t                  size() const { return mSize; }
+    size_t                  availableToRead() const;
+    size_t                  availableToWrite() const;
+
+    // Producer side
+    size_t                  write(const void *buffer, size_t bytes);
+    size_t                  getWriteRegion(void **data) const;
+    void                    advanceWrite(size_t bytes);
+
+    // Consumer side
+    size_t                  read(void *buffer, size_t bytes);
+    size_t                  getReadRegion(const void **data) const;
+    void                    advanceRead(size_t bytes);
+
+    // Only safe while neither side is active.
+    void                    reset();
+
+private:
+    size_t                  contiguous(size_t offset) const;
+
+    char *                  mBuffer;
+    size_t                  mSize;
+    size_t                  mFrameSize;
+    volatile int32_t        mFront;
+    volatile int32_t        mRear;
+};
+
+//
+// Polyphase sample rate converter for interleaved float frames, used when a
+// client runs at another rate than the hardware.
+//
+class ALSAResampler
+{
+public:
+    enum quality {
+        LOW_QUALITY = 0,
+        MED_QUALITY,
+        HIGH_QUALITY,
+        DEFAULT_QUALITY = MED_QUALITY
+    };
+
+    ALSAResampler(uint32_t inRate, uint32_t outRate, unsigned int channels,
+                  int quality);
+    virtual                ~ALSAResampler();
+
+    uint32_t                inRate() const { return mInRate; }
+    uint32_t                outRate() const { return mOutRate; }
+    unsigned int            channels() const { return mChannels; }
+    int                     quality() const { return mQuality; }
+
+    // Input needed to produce outFrames, and output inFrames will produce.
+    size_t                  inputFramesFor(size_t outFrames) const;
+    size_t                  outputFramesFor(size_t inFrames) const;
+
+    void                    resample(const float *in, size_t *inFrames,
+                                     float *out, size_t *outFrames);
+    void                    reset();
+
+    // Run faster or slower than the nominal ratio, in parts per million of
+    // input consumed, to follow a clock that drifts against the output.
+    void                    setDrift(int ppm);
+
+private:
+    void                    buildFilter(double beta, double rolloff);
+    size_t                  append(const float *in, size_t frames);
+    size_t                  compact();
+
+    uint32_t                mInRate;
+    uint32_t                mOutRate;
+    unsigned int            mChannels;
+    int                     mQuality;
+
+    int                     mTaps;
+    int                     mPhases;
+    bool                    mInterpolate;
+    float *                 mFilter;        // mPhases + 1 rows of mTaps
+
+    float *                 mBuffer;        // mChannels rows of mCapacity
+    size_t                  mCapacity;
+    size_t                  mFill;
+    uint64_t                mPosition;      // 32.32 input frames into mBuffer
+    uint64_t                mStep;
+};
+
+//
+// Conversion between the sample formats streams deal in and float.
+//
+class ALSAFormat
+{
+public:
+    // Whether samples of this format can be converted at all.
+    static bool             supported(snd_pcm_format_t format);
+
+    static snd_pcm_format_t fromAudioSystem(int format);
+    static int              toAudioSystem(snd_pcm_format_t format);
+
+    // Converts interleaved frames. Kernels specialised on a channel count
+    // ignore the one passed in.
+    typedef void (*convert_t)(const void *src, void *dst, size_t frames,
+                              unsigned int channels);
+
+    static convert_t        converter(snd_pcm_format_t from,
+                                      snd_pcm_format_t to,
+                                      unsigned int channels);
+
+    // Scales interleaved frames by per channel gains ramping linearly from
+    // one set to the other across the buffer. src and dst may be the same.
+    typedef void (*ramp_t)(const void *src, void *dst, size_t frames,
+                           unsigned int channels, const float *from,
+                           const float *to);
+
+    static ramp_t           ramper(snd_pcm_format_t format);
+};
+
+//
+// Maps interleaved float frames from one channel layout to another through
+// a gain matrix, for clients that do not have the hardware's channel count.
+// Layouts are AudioSystem output channel masks, with frames interleaved in
+// mask bit order unless an order is given for the output, listing the
+// position of each interleaved channel.
+//
+class ALSARemixer
+{
+public:
+    ALSARemixer(uint32_t inMask, uint32_t outMask,
+                const uint32_t *outOrder = 0);
+    virtual                ~ALSARemixer();
+
+    uint32_t                inMask() const { return mInMask; }
+    uint32_t                outMask() const { return mOutMask; }
+    unsigned int            inChannels() const { return mInChannels; }
+    unsigned int            outChannels() const { return mOutChannels; }
+
+    // The matrix has one row of inChannels() gains per output channel.
+    const float *           matrix() const { return mMatrix; }
+    status_t                setMatrix(const float *gains, size_t count);
+    void                    reset();
+
+    void                    remix(const float *in, float *out,
+                                  size_t frames) const;
+
+    static unsigned int     channelCount(uint32_t mask);
+    static uint32_t         inputLayout(uint32_t mask);
+
+    // The order ALSA interleaves a playback layout in, when it is not mask
+    // bit order.
+    static const uint32_t * alsaOrder(uint32_t mask);
+
+private:
+    int                     outIndex(uint32_t channel) const;
+    void                    updateColumns();
+
+    uint32_t                mInMask;
+    uint32_t                mOutMask;
+    const uint32_t *        mOutOrder;
+    unsigned int            mInChannels;
+    unsigned int            mOutChannels;
+    float *                 mMatrix;
+    float *                 mColumns;       // Transposed, rows padded to 4
 };
 
 class ALSAStreamOps
@@ -141,20 +460,253 @@ public:
     int                 format() const;
     uint32_t            channels() const;
 
+    // Called with mLock and mPcmLock held, as is route().
     status_t            open(int mode);
     void                close();
 
+    // A switch asked for while the PCM is playing waits for the next
+    // standby, when applyPendingProfile() makes it. Both are called with
+    // mLock and mPcmLock held.
+    status_t            setProfile(int profile);
+    status_t            applyPendingProfile();
+
+    // The profile a name stands for, or -1.
+    static int          profileIndex(const char *name);
+
 protected:
     friend class AudioHardwareALSA;
 
+    // Point the stream at devices. Called with mLock and mPcmLock held.
+    virtual status_t    route(uint32_t devices, int mode);
+
+    // Every device the stream plays on, which can be more than the PCM's.
+    // Called with mLock or mPcmLock held.
+    virtual uint32_t    routedDevices() const { return mHandle->curDev; }
+
     acoustic_device_t *acoustics();
     ALSAMixer *mixer();
 
+    // Where frame offset starts in the areas of an interleaved memory mapped
+    // PCM, as snd_pcm_mmap_begin() returns them. Shared by both directions.
+    static void *       mmapArea(const snd_pcm_channel_area_t *areas,
+                                 snd_pcm_uframes_t offset);
+
+    // A driver timestamp in nanoseconds.
+    static nsecs_t      timespecToNs(const struct timespec &ts)
+    {
+        return seconds_to_nanoseconds(ts.tv_sec) + ts.tv_nsec;
+    }
+
+    size_t              frameSize() const;
+    snd_pcm_format_t    clientFormat() const;
+    unsigned int        clientChannels() const;
+    size_t              clientFrameSize() const;
+
+    // Sample rate conversion, when the client does not run at the hardware
+    // rate. Called with mLock held.
+    ALSAResampler *     resampler();
+
+    // Channel remixing, when the client does not have the hardware's channel
+    // count. Called with mLock held.
+    ALSARemixer *       remixer();
+
+    // Whether client buffers need converting on their way to or from the
+    // hardware, in rate or in format.
+    bool                converting() const;
+    ssize_t             convertOut(const void *buffer, size_t bytes,
+                                   const void **data);
+
+    // Picks the conversion kernels for the current client and hardware
+    // formats, so that the data path does not look at either.
+    void                selectConverters();
+
+    enum {
+        CONVERT_DIRECT,         // Source format to destination format
+        CONVERT_TO_FLOAT,       // Source format to the resampler
+        CONVERT_FROM_FLOAT,     // Resampler to destination format
+        CONVERT_COUNT
+    };
+
+    enum {
+        SCRATCH_FLOAT_IN,
+        SCRATCH_FLOAT_OUT,
+        SCRATCH_FLOAT_MIX,
+        SCRATCH_PCM,
+        SCRATCH_COUNT
+    };
+
+    void *              scratch(int index, size_t bytes);
+
     AudioHardwareALSA *     mParent;
     alsa_handle_t *         mHandle;
 
-    Mutex                   mLock;
+    //
+    // mLock covers the stream's configuration and client side state, and
+    // mPcmLock the PCM and what only its I/O touches. A writer or reader
+    // thread takes just mPcmLock, so the client never waits on the hardware
+    // through mLock. When both are needed mLock is taken first.
+    //
+    mutable Mutex           mLock;
+    Mutex                   mPcmLock;
     bool                    mPowerLock;
+
+    uint32_t                mSampleRate;        // Client rate, 0 if native
+    snd_pcm_format_t        mFormat;            // Client format, UNKNOWN if native
+    uint32_t                mChannels;          // Client channel mask, 0 if native
+    int                     mResamplerQuality;
+    size_t                  mBufferSize;        // Pinned by a profile switch, 0 if not
+    int                     mPendingProfile;    // Switch left for standby, -1 if none
+    ALSAResampler *         mResampler;
+    ALSARemixer *           mRemixer;
+    ALSAFormat::convert_t   mConvert[CONVERT_COUNT];
+    ALSAFormat::ramp_t      mRamp;              // Gain in the hardware format
+
+    struct scratch_t {
+        void *              data;
+        size_t              size;
+    }                       mScratch[SCRATCH_COUNT];
+};
+
+// ----------------------------------------------------------------------------
+
+//
+// Mixes the output streams sharing a handle into its one PCM, so that a
+// second stream does not have to reopen the PCM from under the first. Each
+// stream queues data in the hardware format into a ring of its own, and a
+// real-time thread sums a period from every ring and writes it out.
+//
+class ALSAStreamMixer : public Thread
+{
+public:
+    struct Track {
+        Track(size_t size) : ring(size), mixed(0), pending(0), underruns(0) {}
+
+        ALSARingBuffer      ring;
+        uint64_t            mixed;          // Frames written to the PCM
+        uint64_t            pending;        // Frames mixed but not written yet
+        uint32_t            underruns;
+    };
+
+    ALSAStreamMixer(alsa_handle_t *handle);
+    virtual            ~ALSAStreamMixer();
+
+    alsa_handle_t *     handle() const { return mHandle; }
+
+    Track *             addTrack();
+    size_t              removeTrack(Track *track);
+
+    // Producer side, called by the streams. queue() blocks only while the
+    // track's ring is full, and flush() until it has been played out.
+    ssize_t             queue(Track *track, const void *buffer, size_t bytes);
+    void                flush(Track *track);
+
+    // Frames of a track presented and written to the PCM, and the
+    // CLOCK_MONOTONIC time at which that was measured.
+    status_t            position(Track *track, uint64_t *presented,
+                                 uint64_t *written, nsecs_t *time);
+
+    // Reroute the shared PCM without the mixer writing to it meanwhile.
+    status_t            route(uint32_t devices, int mode);
+
+    void                stop();
+    void                dump(int fd);
+
+private:
+    virtual status_t    readyToRun();
+    virtual bool        threadLoop();
+
+    size_t              mix(size_t frames);
+    ssize_t             writePcm(const void *buffer, size_t frames);
+
+    alsa_handle_t *     mHandle;
+    size_t              mFrameSize;
+
+    // Kernels for formats summed as float, 0 for 16 bit.
+    ALSAFormat::convert_t   mToFloat;
+    ALSAFormat::convert_t   mFromFloat;
+
+    Mutex               mLock;          // Tracks, positions and waiting
+    Condition           mDataReady;
+    Condition           mSpaceReady;
+    List<Track *>       mTracks;
+
+    Mutex               mPcmLock;       // Everything touching the PCM
+
+    void *              mBuffer;        // One period in the hardware format
+    void *              mTrackBuffer;   // One period of a single track
+    float *             mFloatBuffer;   // Accumulator when not 16 bit
+    float *             mFloatTrack;
+    size_t              mPeriodFrames;
+
+    snd_pcm_sframes_t   mDelay;
+    nsecs_t             mTime;
+    uint32_t            mPeriods;
+    uint32_t            mErrors;
+};
+
+// ----------------------------------------------------------------------------
+
+//
+// Copies of what an output stream writes, played on a PCM per additional
+// device. The copies are made from the stream's own write, and each sink
+// resamples against the drift between its card and the stream's so that
+// the two stay in step.
+//
+class ALSAFanOut
+{
+public:
+    ALSAFanOut();
+    virtual            ~ALSAFanOut();
+
+    // Open a sink for each of the devices, set up like the primary handle.
+    status_t            open(alsa_handle_t *primary, uint32_t devices, int mode);
+    void                close();
+
+    uint32_t            devices() const { return mDevices; }
+
+    // Duplicate frames just written to the primary handle.
+    void                write(alsa_handle_t *primary, const void *buffer,
+                              size_t frames);
+    void                standby();
+
+    void                dump(int fd);
+
+private:
+    struct Sink {
+        alsa_handle_t           handle;
+        ALSAResampler *         resampler;  // Primary to sink rate
+        ALSAFormat::convert_t   fromFloat;
+        bool                    locked;     // baseline is valid
+        int32_t                 baseline;   // Delay difference when locked
+        int32_t                 drift;      // Smoothed change since then
+        int                     ppm;
+        uint32_t                dropped;    // Frames the sink had no room for
+        uint32_t                xruns;
+    };
+
+    void                trim(Sink *sink, alsa_handle_t *primary,
+                             snd_pcm_sframes_t delay);
+    void                writeSink(Sink *sink, const void *buffer, size_t frames);
+    void *              grow(int index, size_t bytes);
+
+    enum {
+        BUFFER_FLOAT_IN = 0,
+        BUFFER_FLOAT_OUT,
+        BUFFER_PCM,
+        BUFFER_COUNT
+    };
+
+    List<Sink *>        mSinks;
+    uint32_t            mDevices;
+
+    // Primary format the float kernel was picked for.
+    snd_pcm_format_t    mFormat;
+    ALSAFormat::convert_t   mToFloat;
+
+    struct {
+        void *          data;
+        size_t          size;
+    }                   mBuffers[BUFFER_COUNT];
 };
 
 // ----------------------------------------------------------------------------
@@ -203,13 +755,209 @@ public:
     // the output has exited standby
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
+    // return the number of frames presented since the stream was opened and
+    // the CLOCK_MONOTONIC time at which that was measured. Never blocks on
+    // the write path.
+    status_t            getPresentationPosition(uint64_t *frames,
+                                                struct timespec *timestamp);
+
     status_t            open(int mode);
     status_t            close();
 
+    // Play through a mixer shared with the other streams on the handle, on
+    // a track already added to it.
+    void                setStreamMixer(const sp<ALSAStreamMixer> &mixer,
+                                       ALSAStreamMixer::Track *track);
+
+    // Play on all of the devices, copying to those the PCM does not reach.
+    status_t            setDevices(uint32_t devices);
+
+protected:
+    virtual status_t    route(uint32_t devices, int mode);
+    virtual uint32_t    routedDevices() const;
+
 private:
+    //
+    // Optional real-time thread that feeds the PCM out of a ring, so that
+    // write() never waits on the hardware with the stream lock held.
+    //
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(AudioStreamOutALSA *stream, size_t bufferSize);
+        virtual            ~WriterThread();
+
+        ssize_t             queue(const void *buffer, size_t bytes);
+        void                flush();
+        void                stop();
+
+        void                dump(int fd);
+
+    private:
+        virtual status_t    readyToRun();
+        virtual bool        threadLoop();
+
+        AudioStreamOutALSA *mStream;
+        ALSARingBuffer      mRing;
+
+        Mutex               mWaitLock;
+        Condition           mDataReady;
+        Condition           mSpaceReady;
+        bool                mStarved;
+
+        // Statistics, reported by dump(). The backlog is the room beyond a
+        // period the PCM had when the thread came back to it, in usec.
+        size_t              mLowWater;
+        uint32_t            mUnderruns;
+        uint32_t            mBacklog;
+        uint32_t            mMaxBacklog;
+        uint64_t            mTotalBacklog;
+        uint32_t            mWakeups;
+    };
+
+    friend class WriterThread;
+
+    ssize_t             writePcm(const void *buffer, size_t bytes);
+    const void *        applyVolume(const void *buffer, const void *data,
+                                    size_t bytes);
+    snd_pcm_sframes_t   mmapWrite(const void *buffer, snd_pcm_uframes_t frames);
+    void                stopWriter();
+
+    //
+    // Where playback was at a given time. Written under mPcmLock and read
+    // without it, guarded by a sequence count that is odd while an update
+    // is in progress.
+    //
+    struct position_t {
+        uint64_t        presented;      // Frames played since open
+        uint64_t        written;        // Frames sent to the PCM since open
+        uint64_t        standby;        // Frames written at the last standby
+        nsecs_t         time;           // CLOCK_MONOTONIC
+        bool            running;
+    };
+
+    void                updatePosition();
+    void                readPosition(position_t *position) const;
+    void                updateLatency(snd_pcm_sframes_t delay);
+
+    // Software volume, for devices without a mixer element. The gain ramps
+    // from mGain to mVolume over the next buffer written, and the stage is
+    // skipped once both are back at unity.
+    enum { MAX_GAIN_CHANNELS = 8 };
+
+    bool                mSoftwareVolume;
+    float               mVolume[2];
+    float               mGain[MAX_GAIN_CHANNELS];
+
+    volatile int32_t    mPositionSeq;
+    position_t          mPosition;
+    uint64_t            mFramesWritten;
+
+    // Measured latency, see latency()
+    uint32_t            mLatencyDevices;    // Route the figures belong to
+    uint32_t            mLatencyOffset;     // Calibrated offset in usec
+    volatile int32_t    mDelayAverage;      // Frames, 0 until measured
+    volatile int32_t    mWriterQueued;      // Bytes in the writer's ring
+
     uint32_t            mFrameCount;
+    bool                mUseWriter;
+    sp<WriterThread>    mWriter;
+
+    // The mixer this stream plays through when outputs are mixed.
+    sp<ALSAStreamMixer>     mStreamMixer;
+    ALSAStreamMixer::Track *mTrack;
+
+    ALSAFanOut *            mFanOut;
 };
 
+//
+// Captures from the PCM of a handle for every input stream using it, so that
+// a second stream does not have to reopen the PCM from under the first. A
+// real-time thread reads a period at a time into one ring, and each stream
+// takes from it at its own pace through a tap with its own cursor. With a
+// history, capture runs even while nobody reads, and a tap can start from
+// some time back.
+//
+class ALSAStreamSplitter : public Thread
+{
+public:
+    struct Tap {
+        Tap() : cursor(0), active(false), rewind(0), lost(0), overruns(0) {}
+
+        uint64_t            cursor;         // Ring offset of the next read
+        bool                active;         // Reading, not in standby
+        uint32_t            rewind;         // msec back to start reading from
+        uint64_t            lost;           // Frames overwritten unread
+        uint32_t            overruns;
+    };
+
+    ALSAStreamSplitter(alsa_handle_t *handle, acoustic_device_t *acoustics,
+                       uint32_t history);
+    virtual            ~ALSAStreamSplitter();
+
+    alsa_handle_t *     handle() const { return mHandle; }
+
+    // Whether it outlives its streams, keeping a history.
+    bool                persistent() const { return mHistory != 0; }
+
+    Tap *               addTap();
+    size_t              removeTap(Tap *tap);
+
+    // Consumer side, called by the streams. dequeue() waits at most timeout
+    // for the data to arrive, then returns what there is. A tap in standby
+    // stops holding the PCM running, and picks up fresh data when it reads
+    // again.
+    ssize_t             dequeue(Tap *tap, void *buffer, size_t bytes,
+                                nsecs_t timeout);
+    void                standby(Tap *tap);
+
+    // Start a tap from up to msec ago, now if it is reading and otherwise
+    // whenever it starts to.
+    void                rewind(Tap *tap, uint32_t msec);
+
+    // Frames lost to a tap since the last call.
+    unsigned int        takeLost(Tap *tap);
+
+    // Reroute the shared PCM without the thread reading from it meanwhile.
+    status_t            route(uint32_t devices, int mode);
+
+    void                stop();
+    void                dump(int fd);
+
+private:
+    virtual status_t    readyToRun();
+    virtual bool        threadLoop();
+
+    bool                active() const;
+    uint64_t            backlog(uint32_t msec) const;
+    ssize_t             readPcm(void *buffer, size_t frames);
+    void                store(char *dst, const char *src, size_t bytes);
+
+    alsa_handle_t *     mHandle;
+    acoustic_device_t * mAcoustics;
+    size_t              mFrameSize;
+    size_t              mHistory;       // Bytes kept, 0 for none
+
+    Mutex               mLock;          // Taps, ring and waiting
+    Condition           mDataReady;
+    Condition           mActive;
+    List<Tap *>         mTaps;
+
+    char *              mRing;
+    size_t              mSize;          // A power of two
+    uint64_t            mRear;          // Bytes ever written
+
+    Mutex               mPcmLock;       // Everything touching the PCM
+
+    void *              mPeriod;        // One period as read
+    size_t              mPeriodFrames;
+
+    uint32_t            mPeriods;
+    uint32_t            mErrors;
+};
+
+// ----------------------------------------------------------------------------
+
 class AudioStreamInALSA : public AudioStreamIn, public ALSAStreamOps
 {
 public:
@@ -245,10 +993,7 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs)
-    {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
     virtual String8     getParameters(const String8& keys)
     {
@@ -266,11 +1011,73 @@ public:
     status_t            open(int mode);
     status_t            close();
 
-private:
-    void                resetFramesLost();
+    // Capture through a splitter shared with the other streams on the handle.
+    void                setStreamSplitter(const sp<ALSAStreamSplitter> &splitter);
 
-    unsigned int        mFramesLost;
+private:
+    //
+    // Optional real-time thread that drains the PCM into a ring, so that a
+    // client which is late to read() does not overrun the hardware.
+    //
+    class ReaderThread : public Thread
+    {
+    public:
+        ReaderThread(AudioStreamInALSA *stream, size_t bufferSize);
+        virtual            ~ReaderThread();
+
+        ssize_t             dequeue(void *buffer, size_t bytes, nsecs_t timeout);
+        void                stop();
+
+        void                dump(int fd);
+
+    private:
+        virtual status_t    readyToRun();
+        virtual bool        threadLoop();
+
+        AudioStreamInALSA * mStream;
+        ALSARingBuffer      mRing;
+        char *              mDiscard;
+        size_t              mDiscardSize;
+
+        Mutex               mWaitLock;
+        Condition           mDataReady;
+
+        // Statistics, reported by dump()
+        size_t              mHighWater;
+        uint32_t            mOverruns;
+        uint32_t            mDropped;
+    };
+
+    friend class ReaderThread;
+
+    ssize_t             readPcm(void *buffer, size_t bytes);
+    ssize_t             fetch(void *buffer, size_t bytes,
+                              const sp<ReaderThread> &reader, nsecs_t timeout);
+    ssize_t             readConverted(void *buffer, size_t bytes,
+                                      ALSAResampler *rs,
+                                      ALSARemixer *mix,
+                                      const sp<ReaderThread> &reader,
+                                      nsecs_t timeout);
+    snd_pcm_sframes_t   mmapRead(void *buffer, snd_pcm_uframes_t frames);
+    void                stopReader();
+    void                accountXrun(int err);
+
+    unsigned int        resetFramesLost();
+
+    volatile int32_t    mFramesLost;        // Updated atomically
+
+    // Overruns seen by the driver, reported by dump()
+    uint32_t            mXruns;
+    uint64_t            mXrunFrames;
+    nsecs_t             mXrunTime;
+    nsecs_t             mMaxXrunTime;
+    uint64_t            mOverrange;
     AudioSystem::audio_in_acoustics mAcoustics;
+    bool                mUseReader;
+    sp<ReaderThread>    mReader;
+
+    sp<ALSAStreamSplitter>      mStreamSplitter;
+    ALSAStreamSplitter::Tap *   mTap;
 };
 
 class AudioHardwareALSA : public AudioHardwareBase
@@ -346,6 +1153,24 @@ public:
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
 
+    alsa_handle_t *     findHandle(uint32_t devices, int profile);
+
+    // Output streams share a PCM through a mixer when mMixOutputs is set.
+    // A mixer is on mStreamMixers exactly while it has tracks, as tracks
+    // only come and go under mStreamMixersLock.
+    sp<ALSAStreamMixer> streamMixer(alsa_handle_t *handle);
+    sp<ALSAStreamMixer> streamMixer_l(alsa_handle_t *handle);
+    size_t              leaveStreamMixer(const sp<ALSAStreamMixer> &mixer,
+                                         ALSAStreamMixer::Track *track);
+
+    // Input streams share one through a splitter when mShareInputs is set.
+    sp<ALSAStreamSplitter> streamSplitter(alsa_handle_t *handle);
+    void                releaseStreamSplitter(const sp<ALSAStreamSplitter> &splitter);
+
+    status_t            route(alsa_handle_t *handle, uint32_t devices, int mode);
+
+    void                startCaptureHistory(uint32_t msec);
+
     friend class AudioStreamOutALSA;
     friend class AudioStreamInALSA;
     friend class ALSAStreamOps;
@@ -356,6 +1181,17 @@ protected:
     acoustic_device_t * mAcousticDevice;
 
     ALSAHandleList      mDeviceList;
+
+    // Profile output streams are opened on, where their devices have one.
+    int                 mOutputProfile;
+
+    bool                mMixOutputs;
+    Mutex               mStreamMixersLock;
+    List< sp<ALSAStreamMixer> > mStreamMixers;
+
+    bool                mShareInputs;
+    Mutex               mStreamSplittersLock;
+    List< sp<ALSAStreamSplitter> > mStreamSplitters;
 };
 
 // ----------------------------------------------------------------------------
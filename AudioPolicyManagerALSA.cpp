@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 #include "AudioPolicyManagerALSA.h"
 #include <media/mediarecorder.h>
+#include <cutils/properties.h>
 
 namespace android {
 
@@ -38,15 +39,80 @@ extern "C" void destroyAudioPolicyManager(AudioPolicyInterface *interface)
     delete interface;
 }
 
-// Nothing currently different between the Base implementation.
-
 AudioPolicyManagerALSA::AudioPolicyManagerALSA(AudioPolicyClientInterface *clientInterface)
-    : AudioPolicyManagerBase(clientInterface)
+    : AudioPolicyManagerBase(clientInterface), mDeepBuffer(false)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    // The profile the HAL opens the output on, and the one to go back to.
+    property_get("alsa.playback.profile", value, "default");
+    mOutputProfile = String8(value);
 }
 
 AudioPolicyManagerALSA::~AudioPolicyManagerALSA()
 {
 }
 
+status_t AudioPolicyManagerALSA::startOutput(audio_io_handle_t output,
+                                             AudioSystem::stream_type stream,
+                                             int session)
+{
+    status_t status = AudioPolicyManagerBase::startOutput(output, stream, session);
+
+    if (status == NO_ERROR && output == mHardwareOutput)
+        checkOutputProfile();
+
+    return status;
+}
+
+status_t AudioPolicyManagerALSA::stopOutput(audio_io_handle_t output,
+                                            AudioSystem::stream_type stream,
+                                            int session)
+{
+    status_t status = AudioPolicyManagerBase::stopOutput(output, stream, session);
+
+    if (status == NO_ERROR && output == mHardwareOutput)
+        checkOutputProfile();
+
+    return status;
+}
+
+void AudioPolicyManagerALSA::setPhoneState(int state)
+{
+    AudioPolicyManagerBase::setPhoneState(state);
+
+    checkOutputProfile();
+}
+
+void AudioPolicyManagerALSA::checkOutputProfile()
+{
+    if (!strcmp(mOutputProfile.string(), "deep_buffer")) return;
+
+    ssize_t index = mOutputs.indexOfKey(mHardwareOutput);
+    if (index < 0) return;
+
+    AudioOutputDescriptor *outputDesc = mOutputs.valueAt(index);
+    uint32_t music = outputDesc->mRefCount[AudioSystem::MUSIC];
+
+    // Music on its own moves the output to the deep buffer, and it stays
+    // there for as long as music plays. A key click or a notification over
+    // it is not worth a switch. A call needs the usual latency back.
+    bool deepBuffer = !isInCall() && music != 0 &&
+                      (mDeepBuffer || outputDesc->refCount() == music);
+
+    if (deepBuffer == mDeepBuffer) return;
+
+    LOGV("checkOutputProfile() switching to %s",
+         deepBuffer ? "deep_buffer" : mOutputProfile.string());
+
+    // The output keeps the buffer size AudioFlinger sized its mixer for,
+    // and makes the switch once it has played out what it has queued.
+    String8 param;
+    param.appendFormat("output_profile=%s",
+            deepBuffer ? "deep_buffer" : mOutputProfile.string());
+
+    mDeepBuffer = deepBuffer;
+    mpClientInterface->setParameters(mHardwareOutput, param);
+}
+
 }; // namespace android
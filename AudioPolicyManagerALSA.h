@@ -42,7 +42,22 @@ public:
                 AudioPolicyManagerALSA(AudioPolicyClientInterface *clientInterface);
         virtual ~AudioPolicyManagerALSA();
 
-        // Nothing currently different between the Base implementation.
+        virtual status_t startOutput(audio_io_handle_t output,
+                                     AudioSystem::stream_type stream,
+                                     int session = 0);
+        virtual status_t stopOutput(audio_io_handle_t output,
+                                    AudioSystem::stream_type stream,
+                                    int session = 0);
+        virtual void setPhoneState(int state);
+
+protected:
+        // Moves the hardware output to the deep buffer profile once music is
+        // the only active stream, and back to the one it was opened on when
+        // music stops or a call starts.
+        void checkOutputProfile();
+
+        bool mDeepBuffer;
+        String8 mOutputProfile;
 };
 
 };
@@ -27,25 +27,46 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
 
 #include "AudioHardwareALSA.h"
 
+#include <sched.h>
+
 namespace android
 {
 
+// SCHED_FIFO priority of the reader thread, when it is allowed to have one.
+static const int READER_THREAD_PRIORITY = 2;
+
+// Start reading from this many msec back, when sharing a capture history.
+static const char *historyKey = "capture_history_ms";
+
 AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
         alsa_handle_t *handle,
         AudioSystem::audio_in_acoustics audio_acoustics) :
     ALSAStreamOps(parent, handle),
     mFramesLost(0),
-    mAcoustics(audio_acoustics)
+    mXruns(0),
+    mXrunFrames(0),
+    mXrunTime(0),
+    mMaxXrunTime(0),
+    mOverrange(0),
+    mAcoustics(audio_acoustics),
+    mUseReader(false),
+    mTap(0)
 {
     acoustic_device_t *aDev = acoustics();
 
     if (aDev) aDev->set_params(aDev, mAcoustics, NULL);
+
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("alsa.capture.reader_thread", value, "0");
+    mUseReader = atoi(value) || !strcmp(value, "true");
 }
 
 AudioStreamInALSA::~AudioStreamInALSA()
@@ -53,6 +74,42 @@ AudioStreamInALSA::~AudioStreamInALSA()
     close();
 }
 
+void AudioStreamInALSA::setStreamSplitter(const sp<ALSAStreamSplitter> &splitter)
+{
+    AutoMutex lock(mLock);
+
+    mStreamSplitter = splitter;
+    mTap = splitter->addTap();
+}
+
+status_t AudioStreamInALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(historyKey);
+    status_t status = NO_ERROR;
+    int msec;
+
+    if (param.getInt(key, msec) == NO_ERROR) {
+        AutoMutex lock(mLock);
+
+        if (mStreamSplitter == 0)
+            status = INVALID_OPERATION;
+        else if (msec < 0)
+            status = BAD_VALUE;
+        else
+            mStreamSplitter->rewind(mTap, msec);
+
+        param.remove(key);
+    }
+
+    if (param.size()) {
+        status_t err = ALSAStreamOps::setParameters(param.toString());
+        if (status == NO_ERROR) status = err;
+    }
+
+    return status;
+}
+
 status_t AudioStreamInALSA::setGain(float gain)
 {
     return mixer() ? mixer()->setMasterGain(gain) : (status_t)NO_INIT;
@@ -60,49 +117,337 @@ status_t AudioStreamInALSA::setGain(float gain)
 
 ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 {
-    AutoMutex lock(mLock);
+    sp<ReaderThread> reader;
+    ALSAResampler *rs;
+    ALSARemixer *mix;
+    bool convert;
+    bool direct;
+    nsecs_t timeout;
+
+    {
+        AutoMutex lock(mLock);
+
+        if (!mPowerLock) {
+            acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioInLock");
+            mPowerLock = true;
+        }
+
+        acoustic_device_t *aDev = acoustics();
+
+        // If there is an acoustics module read method, then it overrides this
+        // implementation (unlike AudioStreamOutALSA write).
+        if (aDev && aDev->read)
+            return aDev->read(aDev, buffer, bytes);
+
+        if (mUseReader && mReader == 0 && mStreamSplitter == 0) {
+            mReader = new ReaderThread(this, bufferSize() * 2);
+            if (mReader->run("ALSAReader", PRIORITY_URGENT_AUDIO) != NO_ERROR) {
+                LOGE("Unable to start the reader thread, reading directly");
+                mReader.clear();
+                mUseReader = false;
+            }
+        }
+
+        rs = resampler();
+        mix = remixer();
+        convert = converting();
 
-    if (!mPowerLock) {
-        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioInLock");
-        mPowerLock = true;
+        reader = mReader;
+        direct = mReader == 0 && mStreamSplitter == 0;
+
+        // Give the hardware twice the time the request takes to capture
+        // before handing back what there is.
+        uint64_t frames = bytes / clientFrameSize();
+        timeout = 2 * s2ns(frames) / sampleRate();
     }
 
-    acoustic_device_t *aDev = acoustics();
+    // Reading straight from the PCM takes only mPcmLock, so the rest of the
+    // stream does not wait on the hardware either way.
+    if (direct) {
+        AutoMutex pcmLock(mPcmLock);
+        return convert ? readConverted(buffer, bytes, rs, mix, reader, 0) :
+                         readPcm(buffer, bytes);
+    }
+
+    if (convert)
+        return readConverted(buffer, bytes, rs, mix, reader, timeout);
+
+    return fetch(buffer, bytes, reader, timeout);
+}
+
+//
+// Hardware frames from the splitter shared with other streams, from the
+// reader thread, or straight from the PCM with mPcmLock held, in that order.
+//
+ssize_t AudioStreamInALSA::fetch(void *buffer, size_t bytes,
+                                 const sp<ReaderThread> &reader, nsecs_t timeout)
+{
+    if (mStreamSplitter != 0)
+        return mStreamSplitter->dequeue(mTap, buffer, bytes, timeout);
+
+    if (reader != 0)
+        return reader->dequeue(buffer, bytes, timeout);
+
+    return readPcm(buffer, bytes);
+}
+
+//
+// Fill a client buffer at the client rate, format and channel layout,
+// pulling exactly as many frames from the hardware as the resampler, if
+// any, needs for it. The frames come from wherever fetch() gets them, and
+// mPcmLock is held when that is the PCM itself.
+//
+ssize_t AudioStreamInALSA::readConverted(void *buffer, size_t bytes,
+                                         ALSAResampler *rs,
+                                         ALSARemixer *mix,
+                                         const sp<ReaderThread> &reader,
+                                         nsecs_t timeout)
+{
+    char *dst = static_cast<char *>(buffer);
+    unsigned int channels = mHandle->channels;
+    unsigned int clientChannels = ALSAStreamOps::clientChannels();
+    size_t frameSize = ALSAStreamOps::frameSize();
+    size_t clientFrameSize = ALSAStreamOps::clientFrameSize();
+    size_t want = bytes / clientFrameSize;
+    size_t done = 0;
+
+    if (!mConvert[CONVERT_DIRECT]) return INVALID_OPERATION;
+
+    while (done < want) {
+        size_t need = rs ? rs->inputFramesFor(want - done) : want - done;
+        size_t in = 0;
+        size_t out = want - done;
+
+        void *pcm = scratch(SCRATCH_PCM, need * frameSize);
+        if (!pcm) return NO_MEMORY;
+
+        if (need) {
+            ssize_t n = fetch(pcm, need * frameSize, reader, timeout);
+
+            if (n <= 0) return done ? done * clientFrameSize : n;
+
+            in = n / frameSize;
+        }
 
-    // If there is an acoustics module read method, then it overrides this
-    // implementation (unlike AudioStreamOutALSA write).
-    if (aDev && aDev->read)
-        return aDev->read(aDev, buffer, bytes);
+        char *client = dst + done * clientFrameSize;
 
-    snd_pcm_sframes_t n, frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes);
-    status_t          err;
+        if (!rs && !mix) {
+            out = in;
+            mConvert[CONVERT_DIRECT](pcm, client, out, channels);
+        } else {
+            float *f = static_cast<float *>(scratch(SCRATCH_FLOAT_IN,
+                    need * channels * sizeof(float)));
+            if (!f) return NO_MEMORY;
+
+            mConvert[CONVERT_TO_FLOAT](pcm, f, in, channels);
+
+            if (rs) {
+                float *fout = static_cast<float *>(scratch(SCRATCH_FLOAT_OUT,
+                        out * channels * sizeof(float)));
+                if (!fout) return NO_MEMORY;
+
+                rs->resample(f, &in, fout, &out);
+                f = fout;
+            } else
+                out = in;
+
+            if (mix) {
+                float *fmix = static_cast<float *>(scratch(SCRATCH_FLOAT_MIX,
+                        out * clientChannels * sizeof(float)));
+                if (!fmix) return NO_MEMORY;
+
+                mix->remix(f, fmix, out);
+                f = fmix;
+            }
+
+            mConvert[CONVERT_FROM_FLOAT](f, client, out, clientChannels);
+        }
+
+        done += out;
+
+        if (!out && !need) break;
+    }
+
+    return done * clientFrameSize;
+}
+
+//
+// Take data from the PCM, recovering from errors on the way. Called with
+// mPcmLock held, either from read() or from the reader thread.
+//
+ssize_t AudioStreamInALSA::readPcm(void *buffer, size_t bytes)
+{
+    acoustic_device_t *aDev = acoustics();
+
+    snd_pcm_sframes_t n;
+    size_t            received = 0;
 
     do {
-        n = snd_pcm_readi(mHandle->handle, buffer, frames);
-        if (n < frames) {
+        snd_pcm_uframes_t frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes - received);
+
+        // Less than a frame of room left. snd_pcm_readi() would take
+        // nothing and this would go round forever.
+        if (!frames) break;
+
+        if (mHandle->curAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+            n = mmapRead((char *)buffer + received, frames);
+        else
+            n = snd_pcm_readi(mHandle->handle, (char *)buffer + received, frames);
+
+        if (n == -EAGAIN)
+            continue;
+
+        if (n < 0) {
             if (mHandle->handle) {
-                if (n < 0) {
-                    n = snd_pcm_recover(mHandle->handle, n, 0);
+                accountXrun(n);
+
+                // snd_pcm_recover() will return 0 if successful in recovering from
+                // an error, or -errno if the error was unrecoverable.
+                n = snd_pcm_recover(mHandle->handle, n, 0);
+
+                if (aDev && aDev->recover) aDev->recover(aDev, n);
 
-                    if (aDev && aDev->recover) aDev->recover(aDev, n);
-                } else
-                    n = snd_pcm_prepare(mHandle->handle);
+                if (n) return static_cast<ssize_t>(n);
             }
-            return static_cast<ssize_t>(n);
         }
-    } while (n == -EAGAIN);
+        else
+            received += static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
+
+    } while (mHandle->handle && received < bytes);
+
+    return received;
+}
+
+//
+// Copy frames straight out of the DMA area of a memory mapped PCM, letting
+// the acoustics module process them on the way if it wants to. Like
+// snd_pcm_readi(), returns the number of frames transferred, or a negative
+// error code when nothing could be transferred.
+//
+snd_pcm_sframes_t AudioStreamInALSA::mmapRead(void *buffer,
+                                              snd_pcm_uframes_t frames)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    char *dst = static_cast<char *>(buffer);
+    snd_pcm_uframes_t got = 0;
+    int err;
+
+    acoustic_device_t *aDev = acoustics();
+
+    // The stream is left in the SETUP state after it has been stopped.
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_SETUP) {
+        err = snd_pcm_prepare(pcm);
+        if (err < 0) return err;
+    }
+
+    // Nothing starts a memory mapped capture stream for us.
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+        err = snd_pcm_start(pcm);
+        if (err < 0) return err;
+    }
+
+    while (got < frames) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) return got ? got : avail;
+
+        if (avail == 0) {
+            err = snd_pcm_wait(pcm, -1);
+            if (err < 0) return got ? got : err;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t count = frames - got;
+
+        err = snd_pcm_mmap_begin(pcm, &areas, &offset, &count);
+        if (err < 0) return got ? got : err;
+
+        const void *src = mmapArea(areas, offset);
+        size_t bytes = snd_pcm_frames_to_bytes(pcm, count);
+
+        if (!aDev || aDev->common.version < ACOUSTICS_DEVICE_VERSION_PROCESS ||
+            !aDev->process ||
+            aDev->process(aDev, src, dst + snd_pcm_frames_to_bytes(pcm, got), bytes) != NO_ERROR)
+            memcpy(dst + snd_pcm_frames_to_bytes(pcm, got), src, bytes);
+
+        snd_pcm_sframes_t n = snd_pcm_mmap_commit(pcm, offset, count);
+        if (n < 0) return got ? got : n;
+
+        got += n;
+    }
+
+    return got;
+}
+
+//
+// Work out how much audio an overrun or a suspend cost before the stream is
+// recovered. The driver stopped at the trigger timestamp, so everything
+// since then is lost, on top of the captured frames that snd_pcm_recover()
+// is about to throw away. Called with mPcmLock held.
+//
+void AudioStreamInALSA::accountXrun(int err)
+{
+    snd_pcm_status_t *status;
+
+    if (err != -EPIPE && err != -ESTRPIPE) return;
+
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_status(mHandle->handle, status) < 0) return;
+
+    snd_pcm_state_t state = snd_pcm_status_get_state(status);
+    if (state != SND_PCM_STATE_XRUN && state != SND_PCM_STATE_SUSPENDED)
+        return;
 
-    return static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
+    snd_htimestamp_t trigger, now;
+    snd_pcm_status_get_trigger_htstamp(status, &trigger);
+    snd_pcm_status_get_htstamp(status, &now);
+
+    nsecs_t elapsed = timespecToNs(now) - timespecToNs(trigger);
+    if (elapsed < 0 || !timespecToNs(trigger)) elapsed = 0;
+
+    uint64_t frames = snd_pcm_status_get_avail(status) +
+                      elapsed * mHandle->sampleRate / seconds_to_nanoseconds(1);
+
+    android_atomic_add(frames, &mFramesLost);
+    mXruns++;
+    mXrunFrames += frames;
+    mXrunTime += elapsed;
+    if (elapsed > mMaxXrunTime) mMaxXrunTime = elapsed;
+    mOverrange += snd_pcm_status_get_overrange(status);
+
+    LOGW("Capture %s lost %llu frames (%lld us)",
+            state == SND_PCM_STATE_XRUN ? "overrun" : "suspend",
+            frames, elapsed / 1000);
 }
 
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
 {
+    AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
+
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "Capture: %u overruns, %llu frames lost, "
+            "%lld us total, %lld us longest, %llu overrange\n",
+            mXruns, mXrunFrames, mXrunTime / 1000, mMaxXrunTime / 1000,
+            mOverrange);
+    result.append(buffer);
+
+    ::write(fd, result.string(), result.size());
+
+    if (mReader != 0) mReader->dump(fd);
+    if (mStreamSplitter != 0) mStreamSplitter->dump(fd);
+
     return NO_ERROR;
 }
 
 status_t AudioStreamInALSA::open(int mode)
 {
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
 
     status_t status = ALSAStreamOps::open(mode);
 
@@ -114,9 +459,49 @@ status_t AudioStreamInALSA::open(int mode)
     return status;
 }
 
+void AudioStreamInALSA::stopReader()
+{
+    sp<ReaderThread> reader;
+
+    {
+        AutoMutex lock(mLock);
+        reader = mReader;
+        mReader.clear();
+    }
+
+    // The reader thread takes mPcmLock itself, so it is stopped without
+    // holding any lock.
+    if (reader != 0) reader->stop();
+}
+
 status_t AudioStreamInALSA::close()
 {
+    stopReader();
+
+    sp<ALSAStreamSplitter> splitter = mStreamSplitter;
+
+    if (splitter != 0) {
+        size_t remaining = splitter->removeTap(mTap);
+
+        AutoMutex lock(mLock);
+
+        mStreamSplitter.clear();
+        mTap = 0;
+
+        if (mPowerLock) {
+            release_wake_lock ("AudioInLock");
+            mPowerLock = false;
+        }
+
+        // The other streams, or the history, keep capturing from the PCM.
+        if (remaining || splitter->persistent()) return NO_ERROR;
+    }
+
+    // The last stream out stops the splitter before closing the PCM under it.
+    if (splitter != 0) mParent->releaseStreamSplitter(splitter);
+
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
 
     acoustic_device_t *aDev = acoustics();
 
@@ -134,8 +519,15 @@ status_t AudioStreamInALSA::close()
 
 status_t AudioStreamInALSA::standby()
 {
+    // Nobody is reading, so stop draining the hardware. read() restarts
+    // the thread with an empty ring.
+    stopReader();
+
     AutoMutex lock(mLock);
 
+    if (mStreamSplitter != 0) mStreamSplitter->standby(mTap);
+    if (mResampler) mResampler->reset();
+
     if (mPowerLock) {
         release_wake_lock ("AudioInLock");
         mPowerLock = false;
@@ -144,19 +536,28 @@ status_t AudioStreamInALSA::standby()
     return NO_ERROR;
 }
 
-void AudioStreamInALSA::resetFramesLost()
+unsigned int AudioStreamInALSA::resetFramesLost()
 {
+    // Whoever reads the PCM adds to the count without mLock, so take it
+    // and clear it in one go rather than wait on the hardware for it.
+    int32_t count;
+
+    do {
+        count = android_atomic_acquire_load(&mFramesLost);
+    } while (android_atomic_cmpxchg(count, 0, &mFramesLost));
+
     AutoMutex lock(mLock);
-    mFramesLost = 0;
+
+    if (mStreamSplitter != 0) count += mStreamSplitter->takeLost(mTap);
+
+    return count;
 }
 
 unsigned int AudioStreamInALSA::getInputFramesLost() const
 {
-    unsigned int count = mFramesLost;
     // Stupid interface wants us to have a side effect of clearing the count
     // but is defined as a const to prevent such a thing.
-    ((AudioStreamInALSA *)this)->resetFramesLost();
-    return count;
+    return ((AudioStreamInALSA *)this)->resetFramesLost();
 }
 
 status_t AudioStreamInALSA::setAcousticParams(void *params)
@@ -168,4 +569,154 @@ status_t AudioStreamInALSA::setAcousticParams(void *params)
     return aDev ? aDev->set_params(aDev, mAcoustics, params) : (status_t)NO_ERROR;
 }
 
+// ----------------------------------------------------------------------------
+
+AudioStreamInALSA::ReaderThread::ReaderThread(AudioStreamInALSA *stream,
+                                              size_t bufferSize) :
+    Thread(false),
+    mStream(stream),
+    mRing(bufferSize, stream->ALSAStreamOps::frameSize()),
+    mDiscard(0),
+    mDiscardSize(bufferSize / 2 - bufferSize / 2 % stream->ALSAStreamOps::frameSize()),
+    mHighWater(0),
+    mOverruns(0),
+    mDropped(0)
+{
+    mDiscard = static_cast<char *>(malloc(mDiscardSize));
+}
+
+AudioStreamInALSA::ReaderThread::~ReaderThread()
+{
+    free(mDiscard);
+}
+
+status_t AudioStreamInALSA::ReaderThread::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = READER_THREAD_PRIORITY;
+
+    // Fall back to the urgent audio nice level given to run() when the
+    // process is not allowed to use real-time scheduling.
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+        LOGW("Unable to set SCHED_FIFO for the reader thread: %s", strerror(err));
+
+    return NO_ERROR;
+}
+
+//
+// Consumer side, called by read(). Waits at most timeout for the data to
+// arrive, then returns what there is.
+//
+ssize_t AudioStreamInALSA::ReaderThread::dequeue(void *buffer, size_t bytes,
+                                                 nsecs_t timeout)
+{
+    char *dst = static_cast<char *>(buffer);
+    size_t done = 0;
+    nsecs_t deadline = systemTime() + timeout;
+
+    AutoMutex lock(mWaitLock);
+
+    for (;;) {
+        done += mRing.read(dst + done, bytes - done);
+        if (done == bytes || exitPending()) break;
+
+        nsecs_t remaining = deadline - systemTime();
+        if (remaining <= 0) break;
+
+        mDataReady.waitRelative(mWaitLock, remaining);
+    }
+
+    return done;
+}
+
+void AudioStreamInALSA::ReaderThread::stop()
+{
+    requestExit();
+
+    {
+        AutoMutex lock(mWaitLock);
+        mDataReady.broadcast();
+    }
+
+    requestExitAndWait();
+}
+
+bool AudioStreamInALSA::ReaderThread::threadLoop()
+{
+    void *data;
+    size_t bytes = mRing.getWriteRegion(&data);
+    bool overrun = !bytes;
+
+    // The ring is full because the client is late. The hardware must be
+    // drained regardless, so the new data is dropped and accounted for.
+    if (overrun) {
+        data = mDiscard;
+        bytes = mDiscardSize;
+    }
+
+    ssize_t n;
+
+    {
+        // Only the PCM lock, so that read() and the rest of the stream do
+        // not wait on the hardware behind this.
+        AutoMutex lock(mStream->mPcmLock);
+
+        alsa_handle_t *handle = mStream->mHandle;
+
+        if (handle->handle) {
+            snd_pcm_uframes_t bufferSize, periodSize;
+            snd_pcm_get_params(handle->handle, &bufferSize, &periodSize);
+
+            // Drain the hardware a period at a time.
+            size_t periodBytes = snd_pcm_frames_to_bytes(handle->handle, periodSize);
+            if (periodBytes && bytes > periodBytes) bytes = periodBytes;
+
+            n = mStream->readPcm(data, bytes);
+
+            if (overrun && n > 0) {
+                snd_pcm_sframes_t frames = snd_pcm_bytes_to_frames(handle->handle, n);
+                android_atomic_add(frames, &mStream->mFramesLost);
+                mDropped += frames;
+                mOverruns++;
+            }
+        } else
+            n = 0;
+    }
+
+    if (n <= 0) {
+        // Closed underneath us, or an unrecoverable error. Do not spin.
+        usleep(10000);
+        return true;
+    }
+
+    if (!overrun) {
+        mRing.advanceWrite(n);
+
+        size_t fill = mRing.availableToRead();
+        if (fill > mHighWater) mHighWater = fill;
+    }
+
+    AutoMutex lock(mWaitLock);
+    mDataReady.signal();
+
+    return true;
+}
+
+void AudioStreamInALSA::ReaderThread::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "Reader thread: ring %u of %u bytes, high water %u bytes\n",
+            mRing.availableToRead(), mRing.size(), mHighWater);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "Reader thread: %u overruns, %u frames dropped\n",
+            mOverruns, mDropped);
+    result.append(buffer);
+
+    ::write(fd, result.string(), result.size());
+}
+
 }       // namespace android
@@ -27,12 +27,16 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
 
 #include "AudioHardwareALSA.h"
 
+#include <sched.h>
+#include <time.h>
+
 #ifndef ALSA_DEFAULT_SAMPLE_RATE
 #define ALSA_DEFAULT_SAMPLE_RATE 44100 // in Hz
 #endif
@@ -44,17 +48,86 @@ namespace android
 
 static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 
+// SCHED_FIFO priority of the writer thread, when it is allowed to have one.
+static const int WRITER_THREAD_PRIORITY = 2;
+
+// Weight of the latest delay sample in the latency average, as a shift.
+static const int DELAY_AVERAGE_SHIFT = 3;
+
+//
+// Latency the driver can not see, such as codec or amplifier delay and the
+// Bluetooth link, in usec. Set per board with these properties.
+//
+struct latency_calibration_t {
+    uint32_t    devices;
+    const char *property;
+};
+
+static const latency_calibration_t latencyCalibration[] = {
+    { AudioSystem::DEVICE_OUT_EARPIECE,         "alsa.latency.earpiece" },
+    { AudioSystem::DEVICE_OUT_SPEAKER,          "alsa.latency.speaker" },
+    { AudioSystem::DEVICE_OUT_WIRED_HEADSET |
+      AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,  "alsa.latency.headset" },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT, "alsa.latency.sco" },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER, "alsa.latency.a2dp" },
+    { AudioSystem::DEVICE_OUT_AUX_DIGITAL,      "alsa.latency.hdmi" },
+};
+
+#define LATENCY_CALIBRATION_COUNT \
+    (sizeof(latencyCalibration) / sizeof(latencyCalibration[0]))
+
+// The largest offset of the devices in use, as they play in parallel.
+static uint32_t latencyOffset(uint32_t devices)
+{
+    char value[PROPERTY_VALUE_MAX];
+    uint32_t offset = 0;
+
+    for (size_t i = 0; i < LATENCY_CALIBRATION_COUNT; i++)
+        if (devices & latencyCalibration[i].devices) {
+            property_get(latencyCalibration[i].property, value, "0");
+            uint32_t usec = strtoul(value, 0, 0);
+            if (usec > offset) offset = usec;
+        }
+
+    return offset;
+}
+
 // ----------------------------------------------------------------------------
 
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     ALSAStreamOps(parent, handle),
-    mFrameCount(0)
+    mSoftwareVolume(false),
+    mPositionSeq(0),
+    mFramesWritten(0),
+    mLatencyDevices(0),
+    mLatencyOffset(0),
+    mDelayAverage(0),
+    mWriterQueued(0),
+    mFrameCount(0),
+    mUseWriter(false),
+    mTrack(0),
+    mFanOut(0)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    mVolume[0] = mVolume[1] = 1.0f;
+    for (int c = 0; c < MAX_GAIN_CHANNELS; c++)
+        mGain[c] = 1.0f;
+
+    property_get("alsa.playback.writer_thread", value, "0");
+    mUseWriter = atoi(value) || !strcmp(value, "true");
+
+    memset(&mPosition, 0, sizeof(mPosition));
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
 {
     close();
+    delete mFanOut;
 }
 
 uint32_t AudioStreamOutALSA::channels() const
@@ -65,33 +138,216 @@ uint32_t AudioStreamOutALSA::channels() const
 
 status_t AudioStreamOutALSA::setVolume(float left, float right)
 {
-    return mixer()->setVolume (mHandle->curDev, left, right);
+    uint32_t devices;
+
+    {
+        AutoMutex lock(mLock);
+        devices = routedDevices();
+    }
+
+    bool hardware = mixer()->setVolume (devices, left, right) == NO_ERROR;
+
+    AutoMutex lock(mLock);
+
+    // Without a volume control for the device the gain goes on the data,
+    // and with one any software gain left over ramps back to unity.
+    if (hardware)
+        left = right = 1.0f;
+
+    mVolume[0] = left < 0.0f ? 0.0f : left > 1.0f ? 1.0f : left;
+    mVolume[1] = right < 0.0f ? 0.0f : right > 1.0f ? 1.0f : right;
+
+    if (mVolume[0] != 1.0f || mVolume[1] != 1.0f)
+        mSoftwareVolume = true;
+
+    return NO_ERROR;
 }
 
-ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
+//
+// Apply the software volume to data about to be written, in place when it
+// is already scratch space. Even channels take the left gain and odd ones
+// the right. Called with mLock held.
+//
+const void *AudioStreamOutALSA::applyVolume(const void *buffer,
+                                            const void *data, size_t bytes)
+{
+    unsigned int channels = mHandle->channels;
+
+    if (!mSoftwareVolume || !mRamp || channels > MAX_GAIN_CHANNELS)
+        return data;
+
+    void *dst = data == buffer ? scratch(SCRATCH_PCM, bytes) :
+                                 const_cast<void *>(data);
+    if (!dst) return data;
+
+    float target[MAX_GAIN_CHANNELS];
+    bool unity = true;
+
+    for (unsigned int c = 0; c < channels; c++) {
+        target[c] = mVolume[c & 1];
+        if (target[c] != 1.0f || mGain[c] != 1.0f) unity = false;
+    }
+
+    if (unity) {
+        mSoftwareVolume = false;
+        return data;
+    }
+
+    mRamp(data, dst, bytes / ALSAStreamOps::frameSize(), channels, mGain, target);
+
+    memcpy(mGain, target, channels * sizeof(float));
+
+    return dst;
+}
+
+// Map what was taken of a converted buffer back to the caller's bytes.
+static inline ssize_t clientBytes(ssize_t n, size_t size, size_t bytes)
+{
+    if (n < 0 || size == bytes) return n;
+
+    return (size_t)n >= size ? bytes : (uint64_t)n * bytes / size;
+}
+
+void AudioStreamOutALSA::setStreamMixer(const sp<ALSAStreamMixer> &mixer,
+                                        ALSAStreamMixer::Track *track)
 {
     AutoMutex lock(mLock);
 
-    if (!mPowerLock) {
-        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
-        mPowerLock = true;
+    mStreamMixer = mixer;
+    mTrack = track;
+}
+
+status_t AudioStreamOutALSA::setDevices(uint32_t devices)
+{
+    AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
+
+    return route(devices, mParent->mode());
+}
+
+//
+// The PCM plays on the first of the devices and the rest get copies, unless
+// a mixer shares the PCM or a copy can not be opened. Then it is left to the
+// module to find a PCM that reaches all of them at once.
+//
+status_t AudioStreamOutALSA::route(uint32_t devices, int mode)
+{
+    uint32_t primary = devices & -devices;
+
+    // The measured delay belongs to the old route.
+    android_atomic_release_store(0, &mDelayAverage);
+
+    if (mFanOut) mFanOut->close();
+
+    if (primary == devices || mStreamMixer != 0)
+        return ALSAStreamOps::route(devices, mode);
+
+    status_t err = ALSAStreamOps::route(primary, mode);
+    if (err != NO_ERROR) return err;
+
+    if (!mFanOut) mFanOut = new ALSAFanOut();
+
+    if (mFanOut->open(mHandle, devices & ~primary, mode) == NO_ERROR)
+        return NO_ERROR;
+
+    return ALSAStreamOps::route(devices, mode);
+}
+
+// The PCM's device, and those copies of the output go to.
+uint32_t AudioStreamOutALSA::routedDevices() const
+{
+    return mHandle->curDev | (mFanOut ? mFanOut->devices() : 0);
+}
+
+ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
+{
+    sp<WriterThread> writer;
+    sp<ALSAStreamMixer> mixer;
+    ALSAStreamMixer::Track *track = 0;
+    const void *data;
+    ssize_t size;
+
+    {
+        AutoMutex lock(mLock);
+
+        if (!mPowerLock) {
+            acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
+            mPowerLock = true;
+        }
+
+        acoustic_device_t *aDev = acoustics();
+
+        // For output, we will pass the data on to the acoustics module, but the actual
+        // data is expected to be sent to the audio device directly as well.
+        if (aDev && aDev->write)
+            aDev->write(aDev, buffer, bytes);
+
+        size = convertOut(buffer, bytes, &data);
+        if (size < 0) return size;
+
+        data = applyVolume(buffer, data, size);
+
+        if (mStreamMixer != 0) {
+            mixer = mStreamMixer;
+            track = mTrack;
+        } else {
+            if (mUseWriter && mWriter == 0) {
+                mWriter = new WriterThread(this, bufferSize());
+                if (mWriter->run("ALSAWriter", PRIORITY_URGENT_AUDIO) != NO_ERROR) {
+                    LOGE("Unable to start the writer thread, writing directly");
+                    mWriter.clear();
+                    mUseWriter = false;
+                }
+            }
+
+            if (mWriter == 0) {
+                AutoMutex pcmLock(mPcmLock);
+                return clientBytes(writePcm(data, size), size, bytes);
+            }
+
+            writer = mWriter;
+        }
     }
 
-    acoustic_device_t *aDev = acoustics();
+    // Only the ring is touched from here on, so the caller never waits on
+    // the hardware or on the PCM lock the writer or mixer holds for it.
+    if (mixer != 0)
+        return clientBytes(mixer->queue(track, data, size), size, bytes);
+
+    // Counted in before it goes in, so that the writer thread never takes
+    // out more than latency() has seen.
+    android_atomic_add(size, &mWriterQueued);
 
-    // For output, we will pass the data on to the acoustics module, but the actual
-    // data is expected to be sent to the audio device directly as well.
-    if (aDev && aDev->write)
-        aDev->write(aDev, buffer, bytes);
+    ssize_t n = writer->queue(data, size);
+    if (n < size) android_atomic_add(n > 0 ? n - size : -size, &mWriterQueued);
+
+    return clientBytes(n, size, bytes);
+}
+
+//
+// Send data to the PCM, recovering from errors on the way. Called with
+// mPcmLock held, either from write() or from the writer thread.
+//
+ssize_t AudioStreamOutALSA::writePcm(const void *buffer, size_t bytes)
+{
+    acoustic_device_t *aDev = acoustics();
 
     snd_pcm_sframes_t n;
     size_t            sent = 0;
     status_t          err;
 
     do {
-        n = snd_pcm_writei(mHandle->handle,
-                           (char *)buffer + sent,
-                           snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent));
+        snd_pcm_uframes_t frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent);
+
+        // Less than a frame left over. snd_pcm_writei() would take nothing
+        // and this would go round forever.
+        if (!frames) break;
+
+        if (mHandle->curAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+            n = mmapWrite((char *)buffer + sent, frames);
+        else
+            n = snd_pcm_writei(mHandle->handle, (char *)buffer + sent, frames);
+
         if (n == -EBADFD) {
             // Somehow the stream is in a bad state. The driver probably
             // has a bug and snd_pcm_recover() doesn't seem to handle this.
@@ -112,29 +368,229 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
         }
         else {
             mFrameCount += n;
+            mFramesWritten += n;
             sent += static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
         }
 
     } while (mHandle->handle && sent < bytes);
 
+    if (mFanOut && sent)
+        mFanOut->write(mHandle, buffer, sent / ALSAStreamOps::frameSize());
+
+    updatePosition();
+
     return sent;
 }
 
+//
+// Work out how much has been played from the delay reported by the driver,
+// and publish it with the time of the pointer update it was derived from.
+// Called with mPcmLock held.
+//
+void AudioStreamOutALSA::updatePosition()
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    snd_pcm_sframes_t delay = 0;
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t tstamp;
+    nsecs_t time = systemTime(SYSTEM_TIME_MONOTONIC);
+    bool running = pcm && snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING;
+
+    // snd_pcm_delay() syncs the hardware pointer, which also refreshes the
+    // driver timestamp read right after it. Once drained there is nothing
+    // left to play.
+    if (!pcm || snd_pcm_state(pcm) == SND_PCM_STATE_SETUP ||
+        snd_pcm_delay(pcm, &delay) < 0 || delay < 0)
+        delay = 0;
+
+    if ((uint64_t)delay > mFramesWritten) delay = mFramesWritten;
+
+    if (running) updateLatency(delay);
+
+    if (delay && snd_pcm_htimestamp(pcm, &avail, &tstamp) == 0 &&
+        (tstamp.tv_sec || tstamp.tv_nsec)) {
+        // Older drivers stamp with CLOCK_REALTIME. Tell the two apart by
+        // whichever clock the stamp is closer to, and move it over.
+        nsecs_t stamp = timespecToNs(tstamp);
+        nsecs_t real = systemTime(SYSTEM_TIME_REALTIME);
+
+        if (llabs(real - stamp) < llabs(time - stamp))
+            stamp += time - real;
+
+        if (stamp <= time) time = stamp;
+    }
+
+    android_atomic_inc(&mPositionSeq);
+    mPosition.presented = mFramesWritten - delay;
+    mPosition.written = mFramesWritten;
+    mPosition.time = time;
+    mPosition.running = running;
+    android_atomic_inc(&mPositionSeq);
+}
+
+//
+// Fold a delay sample into the running average behind latency(). The
+// figures start over whenever the route changes. Called with mPcmLock held.
+//
+void AudioStreamOutALSA::updateLatency(snd_pcm_sframes_t delay)
+{
+    int32_t average = mDelayAverage;
+
+    if (routedDevices() != mLatencyDevices) {
+        mLatencyDevices = routedDevices();
+        mLatencyOffset = latencyOffset(mLatencyDevices);
+        average = 0;
+    }
+
+    if (!average)
+        average = delay;
+    else
+        average += (delay - average) >> DELAY_AVERAGE_SHIFT;
+
+    android_atomic_release_store(average ? average : 1, &mDelayAverage);
+}
+
+void AudioStreamOutALSA::readPosition(position_t *position) const
+{
+    int32_t seq;
+
+    do {
+        seq = android_atomic_acquire_load(&mPositionSeq);
+        *position = mPosition;
+    } while ((seq & 1) || android_atomic_release_load(&mPositionSeq) != seq);
+}
+
+//
+// Copy frames straight into the DMA area of a memory mapped PCM. This avoids
+// the second copy into the kernel and the ioctl made by snd_pcm_writei().
+// Like snd_pcm_writei(), returns the number of frames transferred, or a
+// negative error code when nothing could be transferred.
+//
+snd_pcm_sframes_t AudioStreamOutALSA::mmapWrite(const void *buffer,
+                                                snd_pcm_uframes_t frames)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    const char *src = static_cast<const char *>(buffer);
+    snd_pcm_uframes_t written = 0;
+    int err;
+
+    // The stream is left in the SETUP state after it has been drained.
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_SETUP) {
+        err = snd_pcm_prepare(pcm);
+        if (err < 0) return err;
+    }
+
+    while (written < frames) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) return written ? written : avail;
+
+        if (avail == 0) {
+            // The ring is full. Nothing starts a memory mapped stream for
+            // us, so kick it off before waiting for a period to play out.
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                err = snd_pcm_start(pcm);
+                if (err < 0) return written ? written : err;
+            }
+            err = snd_pcm_wait(pcm, -1);
+            if (err < 0) return written ? written : err;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t count = frames - written;
+
+        err = snd_pcm_mmap_begin(pcm, &areas, &offset, &count);
+        if (err < 0) return written ? written : err;
+
+        memcpy(mmapArea(areas, offset),
+               src + snd_pcm_frames_to_bytes(pcm, written),
+               snd_pcm_frames_to_bytes(pcm, count));
+
+        snd_pcm_sframes_t n = snd_pcm_mmap_commit(pcm, offset, count);
+        if (n < 0) return written ? written : n;
+
+        written += n;
+
+        // Start as soon as the profile's start threshold is queued rather
+        // than waiting for the ring to fill up.
+        if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED &&
+            mHandle->bufferSize - (avail - n) >= mHandle->curStartThreshold) {
+            err = snd_pcm_start(pcm);
+            if (err < 0) return written;
+        }
+    }
+
+    return written;
+}
+
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
+
+    if (mWriter != 0) mWriter->dump(fd);
+    if (mStreamMixer != 0) mStreamMixer->dump(fd);
+    if (mFanOut) mFanOut->dump(fd);
+
     return NO_ERROR;
 }
 
 status_t AudioStreamOutALSA::open(int mode)
 {
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
 
     return ALSAStreamOps::open(mode);
 }
 
+void AudioStreamOutALSA::stopWriter()
+{
+    sp<WriterThread> writer;
+
+    {
+        AutoMutex lock(mLock);
+        writer = mWriter;
+        mWriter.clear();
+    }
+
+    // The writer thread takes mPcmLock itself, so it is stopped without
+    // holding any lock.
+    if (writer != 0) {
+        writer->flush();
+        writer->stop();
+    }
+}
+
 status_t AudioStreamOutALSA::close()
 {
+    stopWriter();
+
+    sp<ALSAStreamMixer> mixer = mStreamMixer;
+
+    if (mixer != 0) {
+        mixer->flush(mTrack);
+        size_t remaining = mParent->leaveStreamMixer(mixer, mTrack);
+
+        AutoMutex lock(mLock);
+
+        mStreamMixer.clear();
+        mTrack = 0;
+
+        if (mPowerLock) {
+            release_wake_lock ("AudioOutLock");
+            mPowerLock = false;
+        }
+
+        // The other streams keep playing through the PCM.
+        if (remaining) return NO_ERROR;
+    }
+
+    // The last stream out has stopped the mixer and closes the PCM under it.
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
+
+    if (mFanOut) mFanOut->close();
 
     snd_pcm_drain (mHandle->handle);
     ALSAStreamOps::close();
@@ -149,9 +605,29 @@ status_t AudioStreamOutALSA::close()
 
 status_t AudioStreamOutALSA::standby()
 {
+    sp<WriterThread> writer;
+    sp<ALSAStreamMixer> mixer;
+
+    {
+        AutoMutex lock(mLock);
+        writer = mWriter;
+        mixer = mStreamMixer;
+    }
+
+    // Let the writer thread or the mixer take what is still queued.
+    if (writer != 0) writer->flush();
+    if (mixer != 0) mixer->flush(mTrack);
+
     AutoMutex lock(mLock);
+    AutoMutex pcmLock(mPcmLock);
 
-    snd_pcm_drain (mHandle->handle);
+    // A shared PCM keeps running for the other streams. A drained one is
+    // free to move to the profile asked for while it played.
+    if (mixer == 0) {
+        snd_pcm_drain (mHandle->handle);
+        applyPendingProfile();
+    }
+    if (mFanOut) mFanOut->standby();
 
     if (mPowerLock) {
         release_wake_lock ("AudioOutLock");
@@ -160,23 +636,310 @@ status_t AudioStreamOutALSA::standby()
 
     mFrameCount = 0;
 
+    if (mResampler) mResampler->reset();
+
+    // Everything has been played out, and the render position restarts.
+    uint64_t written = mFramesWritten;
+
+    if (mixer != 0) {
+        uint64_t presented;
+        nsecs_t time;
+
+        if (mixer->position(mTrack, &presented, &written, &time) != NO_ERROR)
+            written = 0;
+    } else
+        updatePosition();
+
+    android_atomic_inc(&mPositionSeq);
+    mPosition.standby = written;
+    android_atomic_inc(&mPositionSeq);
+
     return NO_ERROR;
 }
 
 #define USEC_TO_MSEC(x) ((x + 999) / 1000)
 
+//
+// The delay measured while playing on the current route, plus whatever the
+// calibration says lies beyond the driver. Until there is a measurement,
+// the buffer time stands in for it.
+//
+// No lock is taken, as write() can hold mLock while it waits on the PCM.
+// The figures are read through atomics, in the order updateLatency() and
+// route() publish them, like the presentation position is.
+//
 uint32_t AudioStreamOutALSA::latency() const
 {
+    alsa_handle_t *handle = mHandle;
+    unsigned int latency = handle->latency;
+    int32_t average = android_atomic_acquire_load(&mDelayAverage);
+
+    if (average)
+        latency = (uint64_t)average * 1000000 / handle->sampleRate +
+                  mLatencyOffset;
+
+    // Data queued for the writer thread has to get through the ring first.
+    int32_t queued = android_atomic_acquire_load(&mWriterQueued);
+    if (queued > 0) {
+        uint64_t frames = queued / ALSAStreamOps::frameSize();
+        latency += frames * 1000000 / handle->sampleRate;
+    }
+
+    // As does data queued for the mixer. The track lives as long as the
+    // stream plays through the mixer.
+    ALSAStreamMixer::Track *track = mTrack;
+    if (track) {
+        uint64_t frames = track->ring.availableToRead() / ALSAStreamOps::frameSize();
+        latency += frames * 1000000 / handle->sampleRate;
+    }
+
     // Android wants latency in milliseconds.
-    return USEC_TO_MSEC (mHandle->latency);
+    return USEC_TO_MSEC (latency);
 }
 
 // return the number of audio frames written by the audio dsp to DAC since
 // the output has exited standby
 status_t AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    *dspFrames = mFrameCount;
+    position_t position;
+
+    readPosition(&position);
+
+    // Mixed streams are positioned by the mixer, which owns the PCM.
+    if (mStreamMixer != 0) {
+        nsecs_t time;
+
+        if (mStreamMixer->position(mTrack, &position.presented,
+                                   &position.written, &time) != NO_ERROR)
+            position.presented = position.written = 0;
+
+        position.time = time;
+        position.running = false;
+    }
+
+    // Play out continues between updates, but never past what was written.
+    uint64_t frames = position.presented;
+    if (frames < position.standby) frames = position.standby;
+
+    if (position.running && frames < position.written) {
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - position.time;
+        frames += elapsed * mHandle->sampleRate / seconds_to_nanoseconds(1);
+        if (frames > position.written) frames = position.written;
+    }
+
+    frames -= position.standby;
+
+    // Positions are kept at the hardware rate.
+    if (mSampleRate)
+        frames = frames * mSampleRate / mHandle->sampleRate;
+
+    *dspFrames = static_cast<uint32_t>(frames);
     return NO_ERROR;
 }
 
+status_t AudioStreamOutALSA::getPresentationPosition(uint64_t *frames,
+                                                     struct timespec *timestamp)
+{
+    position_t position;
+
+    readPosition(&position);
+
+    if (mStreamMixer != 0 &&
+        mStreamMixer->position(mTrack, &position.presented,
+                               &position.written, &position.time) != NO_ERROR)
+        return INVALID_OPERATION;
+
+    if (!position.time) return INVALID_OPERATION;
+
+    *frames = position.presented;
+    if (mSampleRate)
+        *frames = *frames * mSampleRate / mHandle->sampleRate;
+
+    timestamp->tv_sec = position.time / seconds_to_nanoseconds(1);
+    timestamp->tv_nsec = position.time % seconds_to_nanoseconds(1);
+
+    return NO_ERROR;
+}
+
+// ----------------------------------------------------------------------------
+
+AudioStreamOutALSA::WriterThread::WriterThread(AudioStreamOutALSA *stream,
+                                               size_t bufferSize) :
+    Thread(false),
+    mStream(stream),
+    mRing(bufferSize, stream->ALSAStreamOps::frameSize()),
+    mStarved(true),
+    mLowWater(0),
+    mUnderruns(0),
+    mBacklog(0),
+    mMaxBacklog(0),
+    mTotalBacklog(0),
+    mWakeups(0)
+{
+    mLowWater = mRing.size();
+}
+
+AudioStreamOutALSA::WriterThread::~WriterThread()
+{
+}
+
+status_t AudioStreamOutALSA::WriterThread::readyToRun()
+{
+    struct sched_param param;
+    param.sched_priority = WRITER_THREAD_PRIORITY;
+
+    // Fall back to the urgent audio nice level given to run() when the
+    // process is not allowed to use real-time scheduling.
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+        LOGW("Unable to set SCHED_FIFO for the writer thread: %s", strerror(err));
+
+    return NO_ERROR;
+}
+
+//
+// Producer side, called by write(). Blocks only while the ring is full.
+//
+ssize_t AudioStreamOutALSA::WriterThread::queue(const void *buffer, size_t bytes)
+{
+    const char *src = static_cast<const char *>(buffer);
+    size_t queued = 0;
+
+    while (queued < bytes) {
+        size_t n = mRing.write(src + queued, bytes - queued);
+        queued += n;
+
+        AutoMutex lock(mWaitLock);
+
+        if (n) mDataReady.signal();
+
+        if (queued < bytes && !mRing.availableToWrite()) {
+            if (exitPending()) break;
+            mSpaceReady.wait(mWaitLock);
+        }
+    }
+
+    return queued;
+}
+
+//
+// Wait until everything queued has been handed to the PCM.
+//
+void AudioStreamOutALSA::WriterThread::flush()
+{
+    AutoMutex lock(mWaitLock);
+
+    while (mRing.availableToRead() && !exitPending())
+        mSpaceReady.wait(mWaitLock);
+}
+
+void AudioStreamOutALSA::WriterThread::stop()
+{
+    requestExit();
+
+    {
+        AutoMutex lock(mWaitLock);
+        mDataReady.signal();
+        mSpaceReady.broadcast();
+    }
+
+    requestExitAndWait();
+}
+
+bool AudioStreamOutALSA::WriterThread::threadLoop()
+{
+    const void *data;
+    size_t bytes = mRing.getReadRegion(&data);
+
+    if (!bytes) {
+        AutoMutex lock(mWaitLock);
+
+        if (!mRing.availableToRead() && !exitPending()) {
+            // Wake up anyone waiting in flush().
+            mSpaceReady.broadcast();
+
+            mStarved = true;
+            mDataReady.wait(mWaitLock);
+        }
+
+        return true;
+    }
+
+    ssize_t n;
+
+    {
+        // Only the PCM lock, so that write() can carry on queueing while
+        // this waits on the hardware.
+        AutoMutex lock(mStream->mPcmLock);
+
+        alsa_handle_t *handle = mStream->mHandle;
+        if (!handle->handle) {
+            // Closed underneath us. There is nowhere for the data to go.
+            mRing.advanceRead(bytes);
+            android_atomic_add(-(int32_t)bytes, &mStream->mWriterQueued);
+            return true;
+        }
+
+        snd_pcm_uframes_t bufferSize, periodSize;
+        snd_pcm_get_params(handle->handle, &bufferSize, &periodSize);
+
+        // Feed the hardware a period at a time.
+        size_t periodBytes = snd_pcm_frames_to_bytes(handle->handle, periodSize);
+        if (periodBytes && bytes > periodBytes) bytes = periodBytes;
+
+        size_t fill = mRing.availableToRead();
+        if (fill < mLowWater) mLowWater = fill;
+
+        if (snd_pcm_state(handle->handle) == SND_PCM_STATE_RUNNING) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(handle->handle);
+
+            // Any room beyond one period has been waiting for us, which
+            // counts against us only if the ring had data all along.
+            if (mStarved)
+                mUnderruns++;
+            else if (avail > (snd_pcm_sframes_t)periodSize) {
+                uint64_t frames = avail - periodSize;
+                mBacklog = frames * 1000000 / handle->sampleRate;
+                if (mBacklog > mMaxBacklog) mMaxBacklog = mBacklog;
+                mTotalBacklog += mBacklog;
+            } else
+                mBacklog = 0;
+
+            mWakeups++;
+        }
+
+        mStarved = false;
+
+        n = mStream->writePcm(data, bytes);
+    }
+
+    // On an unrecoverable error the data is dropped, rather than spinning
+    // on it forever.
+    size_t done = n > 0 ? n : bytes;
+    mRing.advanceRead(done);
+    android_atomic_add(-(int32_t)done, &mStream->mWriterQueued);
+
+    AutoMutex lock(mWaitLock);
+    mSpaceReady.signal();
+
+    return true;
+}
+
+void AudioStreamOutALSA::WriterThread::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "Writer thread: ring %u of %u bytes, low water %u bytes, %u underruns\n",
+            mRing.availableToRead(), mRing.size(), mLowWater, mUnderruns);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "Writer thread: backlog beyond a period %u us, max %u us, average %u us\n",
+            mBacklog, mMaxBacklog,
+            mWakeups ? (uint32_t)(mTotalBacklog / mWakeups) : 0);
+    result.append(buffer);
+
+    ::write(fd, result.string(), result.size());
+}
+
 }       // namespace android
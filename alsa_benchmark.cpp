@@ -0,0 +1,244 @@
+/* alsa_benchmark.cpp
+ **
+ ** Copyright 2008-2010 Wind River Systems
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+//
+// Host tool checking and timing the sample format and rate conversion
+// kernels, so that their SIMD paths can be compared against the scalar
+// ones without a device:
+//
+//   alsa_benchmark [seconds of audio per run]
+//
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Timers.h>
+
+#include "AudioHardwareALSA.h"
+
+using namespace android;
+
+// ----------------------------------------------------------------------------
+
+static const uint32_t BENCH_RATE = 48000;
+static const size_t BLOCK_FRAMES = 1024;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (ok) return;
+
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+}
+
+static void report(const char *what, size_t frames, unsigned int channels,
+                   nsecs_t elapsed)
+{
+    double seconds = elapsed / 1e9;
+    double audio = (double)frames / BENCH_RATE;
+
+    printf("%-32s %u ch %8.2f ms %8.1fx realtime\n", what, channels,
+            seconds * 1e3, seconds > 0 ? audio / seconds : 0.0);
+}
+
+// Over full scale tones plus the values the kernels have to clamp. NaN is
+// only there to be converted, whatever it turns into.
+static void fillFloat(float *buf, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++)
+        buf[i] = sinf(i * 0.001f * (i % 997)) * 1.25f;
+
+    if (samples >= 4) {
+        buf[0] = INFINITY;
+        buf[1] = -INFINITY;
+        buf[2] = NAN;
+        buf[3] = 1.0f;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+struct format_case_t {
+    snd_pcm_format_t    format;
+    size_t              bytes;
+};
+
+static const format_case_t formats[] = {
+    { SND_PCM_FORMAT_S16_LE, 2 },
+    { SND_PCM_FORMAT_S24_LE, 4 },
+    { SND_PCM_FORMAT_S32_LE, 4 },
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+static void benchFormats(size_t frames, unsigned int channels)
+{
+    size_t samples = BLOCK_FRAMES * channels;
+    float *src = new float[samples];
+    float *back = new float[samples];
+    int32_t *pcm = new int32_t[samples];
+
+    fillFloat(src, samples);
+
+    for (size_t f = 0; f < FORMAT_COUNT; f++) {
+        snd_pcm_format_t format = formats[f].format;
+        ALSAFormat::convert_t from =
+                ALSAFormat::converter(SND_PCM_FORMAT_FLOAT_LE, format, channels);
+        ALSAFormat::convert_t to =
+                ALSAFormat::converter(format, SND_PCM_FORMAT_FLOAT_LE, channels);
+        char what[64];
+
+        check(from && to, "converter lookup");
+        if (!from || !to) continue;
+
+        // Clamped, not wrapped around to the opposite end.
+        from(src, pcm, BLOCK_FRAMES, channels);
+        to(pcm, back, BLOCK_FRAMES, channels);
+        check(back[0] > 0.99f, "+inf clamps to full scale");
+        check(back[1] < -0.99f, "-inf clamps to full scale");
+
+        // Rounded, not truncated: one least significant bit is the worst
+        // error a round trip may add.
+        float lsb = formats[f].bytes == 2 ? 1.0f / 32768 : 1.0f / 8388608;
+        float worst = 0;
+        for (size_t i = 4; i < samples; i++) {
+            float s = src[i] > 1.0f ? 1.0f : src[i] < -1.0f ? -1.0f : src[i];
+            float e = fabsf(back[i] - s);
+            if (e > worst) worst = e;
+        }
+        check(worst <= lsb, "round trip within one step");
+
+        nsecs_t start = systemTime();
+        for (size_t done = 0; done < frames; done += BLOCK_FRAMES)
+            from(src, pcm, BLOCK_FRAMES, channels);
+        snprintf(what, sizeof(what), "float to %s", snd_pcm_format_name(format));
+        report(what, frames, channels, systemTime() - start);
+
+        start = systemTime();
+        for (size_t done = 0; done < frames; done += BLOCK_FRAMES)
+            to(pcm, back, BLOCK_FRAMES, channels);
+        snprintf(what, sizeof(what), "%s to float", snd_pcm_format_name(format));
+        report(what, frames, channels, systemTime() - start);
+    }
+
+    delete[] src;
+    delete[] back;
+    delete[] pcm;
+}
+
+// ----------------------------------------------------------------------------
+
+static const uint32_t rates[] = { 8000, 22050, 44100 };
+
+#define RATE_COUNT (sizeof(rates) / sizeof(rates[0]))
+
+static const char *qualityName[] = { "low", "medium", "high" };
+
+static void benchResampler(size_t frames, unsigned int channels)
+{
+    size_t samples = BLOCK_FRAMES * channels;
+    float *in = new float[samples];
+
+    // A quiet tone, well inside every passband.
+    for (size_t i = 0; i < BLOCK_FRAMES; i++)
+        for (unsigned int c = 0; c < channels; c++)
+            in[i * channels + c] = 0.5f * sinf(i * 0.05f);
+
+    for (size_t r = 0; r < RATE_COUNT; r++)
+        for (int q = ALSAResampler::LOW_QUALITY;
+             q <= ALSAResampler::HIGH_QUALITY; q++) {
+            ALSAResampler resampler(rates[r], BENCH_RATE, channels, q);
+            size_t outMax = resampler.outputFramesFor(BLOCK_FRAMES) + 1;
+            float *out = new float[outMax * channels];
+            size_t inTotal = 0;
+            size_t outTotal = 0;
+            size_t outLast = 0;
+            bool finite = true;
+            char what[64];
+
+            // Time the input needed for the requested amount of output.
+            size_t needed = (uint64_t)frames * rates[r] / BENCH_RATE;
+
+            nsecs_t start = systemTime();
+            while (inTotal < needed) {
+                size_t inFrames = BLOCK_FRAMES;
+                size_t outFrames = outMax;
+
+                resampler.resample(in, &inFrames, out, &outFrames);
+
+                if (!inFrames && !outFrames) break;
+                inTotal += inFrames;
+                outTotal += outFrames;
+                outLast = outFrames;
+            }
+            nsecs_t elapsed = systemTime() - start;
+
+            for (size_t i = 0; i < outLast * channels; i++)
+                if (!(fabsf(out[i]) <= 1.0f)) finite = false;
+
+            check(inTotal >= needed, "resampler consumes its input");
+            check(finite, "resampler output stays in range");
+
+            // Output tracks the ratio, give or take the input the resampler
+            // holds on to.
+            size_t expected = (uint64_t)inTotal * BENCH_RATE / rates[r];
+            size_t held = resampler.outputFramesFor(BLOCK_FRAMES);
+            check(outTotal + held >= expected && outTotal <= expected + 1,
+                  "resampler ratio");
+
+            snprintf(what, sizeof(what), "resample %u to %u (%s)",
+                    rates[r], BENCH_RATE, qualityName[q]);
+            report(what, outTotal, channels, elapsed);
+
+            delete[] out;
+        }
+
+    delete[] in;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], 0) : 60.0;
+
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds of audio per run]\n", argv[0]);
+        return EINVAL;
+    }
+
+    size_t frames = (size_t)(seconds * BENCH_RATE);
+
+    printf("Timing %.1f s of %u Hz audio per run\n", seconds, BENCH_RATE);
+
+    for (unsigned int channels = 1; channels <= 2; channels++) {
+        benchFormats(frames, channels);
+        benchResampler(frames, channels);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
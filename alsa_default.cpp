@@ -21,6 +21,11 @@
 #include "AudioHardwareALSA.h"
 #include <media/AudioRecord.h>
 
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
 #undef DISABLE_HARWARE_RESAMPLING
 
 #define ALSA_NAME_MAX 128
@@ -33,6 +38,17 @@
 #define ALSA_DEFAULT_SAMPLE_RATE 44100 // in Hz
 #endif
 
+// Number of negotiated hardware configurations remembered.
+#define ALSA_HW_CACHE_SIZE 16
+
+#ifndef ALSA_PCM_POOL_SIZE
+#define ALSA_PCM_POOL_SIZE 4 // Idle PCMs kept open, 0 to disable
+#endif
+
+#ifndef ALSA_PCM_POOL_IDLE_MS
+#define ALSA_PCM_POOL_IDLE_MS 3000 // How long an idle PCM is kept open
+#endif
+
 namespace android
 {
 
@@ -70,7 +86,7 @@ static int s_device_open(const hw_module_t* module, const char* name,
 
     /* initialize the procs */
     dev->common.tag = HARDWARE_DEVICE_TAG;
-    dev->common.version = 0;
+    dev->common.version = ALSA_DEVICE_VERSION_PROFILES;
     dev->common.module = (hw_module_t *) module;
     dev->common.close = s_device_close;
     dev->init = s_init;
@@ -82,8 +98,11 @@ static int s_device_open(const hw_module_t* module, const char* name,
     return 0;
 }
 
+static int poolFlush();
+
 static int s_device_close(hw_device_t* device)
 {
+    poolFlush();
     free(device);
     return 0;
 }
@@ -109,6 +128,63 @@ static alsa_handle_t _defaultsOut = {
     latency     : 200000, // Desired Delay in usec
     bufferSize  : DEFAULT_SAMPLE_RATE / 5, // Desired Number of samples
     modPrivate  : 0,
+    periods     : 4,
+    startThreshold : 0, // Start when the buffer is full
+    availMin    : 0, // Wake up once a period is free
+    curStartThreshold : 0,
+    curAvailMin : 0,
+    access      : SND_PCM_ACCESS_MMAP_INTERLEAVED,
+    curAccess   : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_DEFAULT,
+};
+
+// Two periods of about 5 ms. Playback starts as soon as the first period is
+// queued, for UI sounds and games.
+static alsa_handle_t _defaultsOutLowLatency = {
+    module      : 0,
+    devices     : AudioSystem::DEVICE_OUT_ALL,
+    curDev      : 0,
+    curMode     : 0,
+    handle      : 0,
+    format      : SND_PCM_FORMAT_S16_LE, // AudioSystem::PCM_16_BIT
+    channels    : 2,
+    sampleRate  : DEFAULT_SAMPLE_RATE,
+    latency     : 10000, // Desired Delay in usec
+    bufferSize  : DEFAULT_SAMPLE_RATE / 80, // Desired Number of samples
+    modPrivate  : 0,
+    periods     : 2,
+    startThreshold : DEFAULT_SAMPLE_RATE / 200,
+    availMin    : DEFAULT_SAMPLE_RATE / 200,
+    curStartThreshold : 0,
+    curAvailMin : 0,
+    access      : SND_PCM_ACCESS_MMAP_INTERLEAVED,
+    curAccess   : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_LOW_LATENCY,
+};
+
+// Over a second of audio in four large periods. The writer is only woken up
+// once about a second of space is free, so long music playback costs a
+// handful of wakeups per second instead of one per period.
+static alsa_handle_t _defaultsOutDeepBuffer = {
+    module      : 0,
+    devices     : AudioSystem::DEVICE_OUT_ALL,
+    curDev      : 0,
+    curMode     : 0,
+    handle      : 0,
+    format      : SND_PCM_FORMAT_S16_LE, // AudioSystem::PCM_16_BIT
+    channels    : 2,
+    sampleRate  : DEFAULT_SAMPLE_RATE,
+    latency     : 1500000, // Desired Delay in usec
+    bufferSize  : DEFAULT_SAMPLE_RATE * 3 / 2, // Desired Number of samples
+    modPrivate  : 0,
+    periods     : 4,
+    startThreshold : 0, // Start when the buffer is full
+    availMin    : DEFAULT_SAMPLE_RATE, // Wake up once a second is free
+    curStartThreshold : 0,
+    curAvailMin : 0,
+    access      : SND_PCM_ACCESS_MMAP_INTERLEAVED,
+    curAccess   : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_DEEP_BUFFER,
 };
 
 static alsa_handle_t _defaultsIn = {
@@ -123,6 +199,14 @@ static alsa_handle_t _defaultsIn = {
     latency     : 250000, // Desired Delay in usec
     bufferSize  : 2048, // Desired Number of samples
     modPrivate  : 0,
+    periods     : 4,
+    startThreshold : 0, // Start on the first frame
+    availMin    : 0, // Wake up once a period is available
+    curStartThreshold : 0,
+    curAvailMin : 0,
+    access      : SND_PCM_ACCESS_MMAP_INTERLEAVED,
+    curAccess   : SND_PCM_ACCESS_RW_INTERLEAVED,
+    profile     : ALSA_PROFILE_DEFAULT,
 };
 
 struct device_suffix_t {
@@ -151,36 +235,100 @@ snd_pcm_stream_t direction(alsa_handle_t *handle)
             : SND_PCM_STREAM_CAPTURE;
 }
 
-const char *deviceName(alsa_handle_t *handle, uint32_t device, int mode)
+static const char *modeSuffix[] = {
+        /* AudioSystem::MODE_NORMAL   : */"_normal",
+        /* AudioSystem::MODE_RINGTONE : */"_ringtone",
+        /* AudioSystem::MODE_IN_CALL  : */"_incall",
+        /* Any other mode             : */"",
+};
+
+static const int modeSuffixLen = (sizeof(modeSuffix) / sizeof(modeSuffix[0]));
+
+//
+// PCM names that exist in the ALSA configuration, resolved once by s_init()
+// for every direction, combination of device suffixes and mode.
+//
+static char deviceNames[SND_PCM_STREAM_LAST + 1][1 << deviceSuffixLen]
+        [modeSuffixLen][ALSA_NAME_MAX];
+
+static int modeIndex(int mode)
+{
+    switch (mode) {
+    case AudioSystem::MODE_NORMAL:
+        return 0;
+    case AudioSystem::MODE_RINGTONE:
+        return 1;
+    case AudioSystem::MODE_IN_CALL:
+        return 2;
+    default:
+        return modeSuffixLen - 1;
+    }
+}
+
+static bool pcmDefined(const char *name)
 {
-    static char devString[ALSA_NAME_MAX];
-    int hasDevExt = 0;
+    snd_config_t *conf;
+
+    if (!snd_config ||
+        snd_config_search_definition(snd_config, "pcm", name, &conf) < 0)
+        return false;
 
-    strcpy(devString, devicePrefix[direction(handle)]);
+    snd_config_delete(conf);
+
+    return true;
+}
+
+//
+// Build the most specific name for each entry, then fall back to less
+// specific ones by dropping suffixes until the configuration defines it.
+// If none of the Android defined audio devices exist, use a generic one.
+// A defined name may still fail to open, s_open() then keeps dropping
+// suffixes from it.
+//
+static void resolveDeviceNames()
+{
+    snd_config_update();
+
+    for (int dir = 0; dir <= SND_PCM_STREAM_LAST; dir++)
+        for (int mask = 0; mask < (1 << deviceSuffixLen); mask++)
+            for (int mode = 0; mode < modeSuffixLen; mode++) {
+                char *devString = deviceNames[dir][mask][mode];
+
+                strcpy(devString, devicePrefix[dir]);
+
+                for (int dev = 0; dev < deviceSuffixLen; dev++)
+                    if (mask & (1 << dev))
+                        ALSA_STRCAT (devString, deviceSuffix[dev].suffix);
+
+                if (mask) ALSA_STRCAT (devString, modeSuffix[mode]);
+
+                while (!pcmDefined(devString)) {
+                    char *tail = strrchr(devString, '_');
+                    if (!tail) {
+                        strcpy(devString, "default");
+                        break;
+                    }
+                    *tail = 0;
+                }
+
+                LOGV("%s devices %02x mode %d uses %s", devicePrefix[dir],
+                        mask, mode, devString);
+            }
+}
+
+const char *deviceName(alsa_handle_t *handle, uint32_t device, int mode)
+{
+    int mask = 0;
 
     for (int dev = 0; device && dev < deviceSuffixLen; dev++)
         if (device & deviceSuffix[dev].device) {
-            ALSA_STRCAT (devString, deviceSuffix[dev].suffix);
             device &= ~deviceSuffix[dev].device;
-            hasDevExt = 1;
+            mask |= 1 << dev;
         }
 
-    if (hasDevExt) switch (mode) {
-    case AudioSystem::MODE_NORMAL:
-        ALSA_STRCAT (devString, "_normal")
-        ;
-        break;
-    case AudioSystem::MODE_RINGTONE:
-        ALSA_STRCAT (devString, "_ringtone")
-        ;
-        break;
-    case AudioSystem::MODE_IN_CALL:
-        ALSA_STRCAT (devString, "_incall")
-        ;
-        break;
-    };
+    const char *devString = deviceNames[direction(handle)][mask][modeIndex(mode)];
 
-    return devString;
+    return *devString ? devString : "default";
 }
 
 const char *streamName(alsa_handle_t *handle)
@@ -188,14 +336,175 @@ const char *streamName(alsa_handle_t *handle)
     return snd_pcm_stream_name(direction(handle));
 }
 
+//
+// Per handle state private to this module, hung off modPrivate.
+//
+// Most ctl_elems hooks a hot route can apply.
+#define ALSA_ROUTE_HOOKS_MAX 4
+
+struct alsa_handle_private_t {
+    snd_pcm_hw_params_t *   hardwareParams;
+
+    // Mixer switches set by a hot route, taken back before the PCM returns
+    // to its own route or is closed.
+    snd_ctl_t *             routeCtl;
+    snd_sctl_t *            routeSctl[ALSA_ROUTE_HOOKS_MAX];
+};
+
+//
+// The outcome of a full hardware parameter negotiation, per PCM name and
+// requested configuration. Later opens of the same PCM apply it in a single
+// exact pass instead of going through the set_*_near() chain again.
+//
+struct alsa_hw_config_t {
+    char                name[ALSA_NAME_MAX];
+    snd_pcm_stream_t    direction;
+    snd_pcm_format_t    format;
+    unsigned int        channels;
+    unsigned int        requestedRate;
+    snd_pcm_access_t    requestedAccess;
+    int                 profile;
+
+    snd_pcm_access_t    access;
+    unsigned int        rate;
+    snd_pcm_uframes_t   periodSize;
+    snd_pcm_uframes_t   bufferSize;
+    unsigned int        latency;
+};
+
+static alsa_hw_config_t hwConfigCache[ALSA_HW_CACHE_SIZE];
+static int hwConfigCacheNext;
+static Mutex hwConfigCacheLock;
+
+static bool hwConfigMatches(const alsa_hw_config_t *config,
+        alsa_handle_t *handle, const char *name)
+{
+    return config->name[0] &&
+           config->direction == direction(handle) &&
+           config->format == handle->format &&
+           config->channels == handle->channels &&
+           config->requestedRate == handle->sampleRate &&
+           config->requestedAccess == handle->access &&
+           config->profile == handle->profile &&
+           strcmp(config->name, name) == 0;
+}
+
+static alsa_hw_config_t *findHwConfig(alsa_handle_t *handle, const char *name)
+{
+    for (int i = 0; i < ALSA_HW_CACHE_SIZE; i++)
+        if (hwConfigMatches(&hwConfigCache[i], handle, name))
+            return &hwConfigCache[i];
+
+    return 0;
+}
+
+static status_t setCachedHardwareParams(alsa_handle_t *handle,
+        snd_pcm_hw_params_t *hardwareParams)
+{
+    const char *name = snd_pcm_name(handle->handle);
+    alsa_hw_config_t config;
+
+    {
+        AutoMutex lock(hwConfigCacheLock);
+
+        alsa_hw_config_t *cached = findHwConfig(handle, name);
+        if (!cached) return NAME_NOT_FOUND;
+
+        config = *cached;
+    }
+
+    int err = snd_pcm_hw_params_any(handle->handle, hardwareParams);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
+                config.access);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_format(handle->handle, hardwareParams,
+                config.format);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_channels(handle->handle, hardwareParams,
+                config.channels);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_rate(handle->handle, hardwareParams,
+                config.rate, 0);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_period_size(handle->handle, hardwareParams,
+                config.periodSize, 0);
+    if (err == 0)
+        err = snd_pcm_hw_params_set_buffer_size(handle->handle, hardwareParams,
+                config.bufferSize);
+    if (err == 0)
+        err = snd_pcm_hw_params(handle->handle, hardwareParams);
+
+    if (err < 0) {
+        LOGW("Cached hardware parameters for %s no longer apply: %s",
+                name, snd_strerror(err));
+
+        AutoMutex lock(hwConfigCacheLock);
+        alsa_hw_config_t *cached = findHwConfig(handle, name);
+        if (cached) cached->name[0] = 0;
+
+        return err;
+    }
+
+    LOGV("Applied cached hardware parameters for %s", name);
+
+    handle->sampleRate = config.rate;
+    handle->bufferSize = config.bufferSize;
+    handle->latency = config.latency;
+    handle->curAccess = config.access;
+
+    return NO_ERROR;
+}
+
+static void storeHardwareParams(alsa_handle_t *handle,
+        snd_pcm_hw_params_t *hardwareParams)
+{
+    const char *name = snd_pcm_name(handle->handle);
+    snd_pcm_access_t access;
+    unsigned int rate;
+    snd_pcm_uframes_t periodSize;
+
+    if (strlen(name) >= ALSA_NAME_MAX ||
+        snd_pcm_hw_params_get_access(hardwareParams, &access) < 0 ||
+        snd_pcm_hw_params_get_rate(hardwareParams, &rate, 0) < 0 ||
+        snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize, 0) < 0)
+        return;
+
+    AutoMutex lock(hwConfigCacheLock);
+
+    alsa_hw_config_t *config = findHwConfig(handle, name);
+    if (!config) {
+        config = &hwConfigCache[hwConfigCacheNext];
+        hwConfigCacheNext = (hwConfigCacheNext + 1) % ALSA_HW_CACHE_SIZE;
+    }
+
+    strcpy(config->name, name);
+    config->direction = direction(handle);
+    config->format = handle->format;
+    config->channels = handle->channels;
+    config->requestedRate = handle->sampleRate;
+    config->requestedAccess = handle->access;
+    config->profile = handle->profile;
+
+    config->access = access;
+    config->rate = rate;
+    config->periodSize = periodSize;
+    config->bufferSize = handle->bufferSize;
+    config->latency = handle->latency;
+}
+
 status_t setHardwareParams(alsa_handle_t *handle)
 {
-    snd_pcm_hw_params_t *hardwareParams;
+    alsa_handle_private_t *priv =
+            static_cast<alsa_handle_private_t *>(handle->modPrivate);
+    snd_pcm_hw_params_t *hardwareParams = priv ? priv->hardwareParams : 0;
     status_t err;
 
     snd_pcm_uframes_t bufferSize = handle->bufferSize;
     unsigned int requestedRate = handle->sampleRate;
     unsigned int latency = handle->latency;
+    unsigned int periods = handle->periods ? handle->periods : 4;
+    snd_pcm_access_t access = handle->access;
 
     // snd_pcm_format_description() and snd_pcm_format_name() do not perform
     // proper bounds checking.
@@ -207,20 +516,32 @@ status_t setHardwareParams(alsa_handle_t *handle)
     const char *formatName = validFormat ? snd_pcm_format_name(handle->format)
             : "UNKNOWN";
 
-    if (snd_pcm_hw_params_malloc(&hardwareParams) < 0) {
+    if (!hardwareParams && snd_pcm_hw_params_malloc(&hardwareParams) < 0) {
         LOG_ALWAYS_FATAL("Failed to allocate ALSA hardware parameters!");
         return NO_INIT;
     }
 
+    // Try the configuration negotiated the last time this PCM was opened.
+    err = setCachedHardwareParams(handle, hardwareParams);
+    if (err == NO_ERROR) goto done;
+
     err = snd_pcm_hw_params_any(handle->handle, hardwareParams);
     if (err < 0) {
         LOGE("Unable to configure hardware: %s", snd_strerror(err));
         goto done;
     }
 
-    // Set the interleaved read and write format.
-    err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
-            SND_PCM_ACCESS_RW_INTERLEAVED);
+    // Set the interleaved transfer method. Memory mapped access lets the
+    // streams write straight into the DMA area, but not every device or
+    // plugin supports it, so fall back to plain read/write.
+    if (access != SND_PCM_ACCESS_RW_INTERLEAVED &&
+        snd_pcm_hw_params_test_access(handle->handle, hardwareParams, access) < 0) {
+        LOGW("%s access is not supported, falling back to read/write",
+                snd_pcm_access_name(access));
+        access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    }
+
+    err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams, access);
     if (err < 0) {
         LOGE("Unable to configure PCM read/write format: %s",
                 snd_strerror(err));
@@ -263,6 +584,9 @@ status_t setHardwareParams(alsa_handle_t *handle)
     else
         LOGV("Set %s sample rate to %u HZ", stream, requestedRate);
 
+    // The streams resample to whatever rate the device ended up with.
+    if (err == 0) handle->sampleRate = requestedRate;
+
 #ifdef DISABLE_HARWARE_RESAMPLING
     // Disable hardware re-sampling.
     err = snd_pcm_hw_params_set_rate_resample(handle->handle,
@@ -291,7 +615,7 @@ status_t setHardwareParams(alsa_handle_t *handle)
             hardwareParams, &latency, NULL);
     if (err < 0) {
         /* That didn't work, set the period instead */
-        unsigned int periodTime = latency / 4;
+        unsigned int periodTime = latency / periods;
         err = snd_pcm_hw_params_set_period_time_near(handle->handle,
                 hardwareParams, &periodTime, NULL);
         if (err < 0) {
@@ -305,7 +629,7 @@ status_t setHardwareParams(alsa_handle_t *handle)
             LOGE("Unable to get the period size for latency: %s", snd_strerror(err));
             goto done;
         }
-        bufferSize = periodSize * 4;
+        bufferSize = periodSize * periods;
         if (bufferSize < handle->bufferSize) bufferSize = handle->bufferSize;
         err = snd_pcm_hw_params_set_buffer_size_near(handle->handle,
                 hardwareParams, &bufferSize);
@@ -326,7 +650,7 @@ status_t setHardwareParams(alsa_handle_t *handle)
             LOGE("Unable to get the buffer time for latency: %s", snd_strerror(err));
             goto done;
         }
-        unsigned int periodTime = latency / 4;
+        unsigned int periodTime = latency / periods;
         err = snd_pcm_hw_params_set_period_time_near(handle->handle,
                 hardwareParams, &periodTime, NULL);
         if (err < 0) {
@@ -344,9 +668,13 @@ status_t setHardwareParams(alsa_handle_t *handle)
     // Commit the hardware parameters back to the device.
     err = snd_pcm_hw_params(handle->handle, hardwareParams);
     if (err < 0) LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
+    else {
+        handle->curAccess = access;
+        storeHardwareParams(handle, hardwareParams);
+    }
 
     done:
-    snd_pcm_hw_params_free(hardwareParams);
+    if (!priv) snd_pcm_hw_params_free(hardwareParams);
 
     return err;
 }
@@ -358,7 +686,7 @@ status_t setSoftwareParams(alsa_handle_t *handle)
 
     snd_pcm_uframes_t bufferSize = 0;
     snd_pcm_uframes_t periodSize = 0;
-    snd_pcm_uframes_t startThreshold, stopThreshold;
+    snd_pcm_uframes_t startThreshold, stopThreshold, availMin;
 
     if (snd_pcm_sw_params_malloc(&softwareParams) < 0) {
         LOG_ALWAYS_FATAL("Failed to allocate ALSA software parameters!");
@@ -377,8 +705,10 @@ status_t setSoftwareParams(alsa_handle_t *handle)
 
     if (handle->devices & AudioSystem::DEVICE_OUT_ALL) {
         // For playback, configure ALSA to start the transfer when the
-        // buffer is full.
+        // buffer is full, unless the profile wants to start sooner.
         startThreshold = bufferSize - 1;
+        if (handle->startThreshold && handle->startThreshold < startThreshold)
+            startThreshold = handle->startThreshold;
         stopThreshold = bufferSize;
     } else {
         // For recording, configure ALSA to start the transfer on the
@@ -404,19 +734,33 @@ status_t setSoftwareParams(alsa_handle_t *handle)
     }
 
     // Allow the transfer to start when at least periodSize samples can be
-    // processed.
+    // processed, or whatever the profile asks for.
+    availMin = periodSize;
+    if (handle->availMin)
+        availMin = handle->availMin < bufferSize ? handle->availMin : bufferSize;
+
     err = snd_pcm_sw_params_set_avail_min(handle->handle, softwareParams,
-            periodSize);
+            availMin);
     if (err < 0) {
         LOGE("Unable to configure available minimum to %lu: %s",
-                periodSize, snd_strerror(err));
+                availMin, snd_strerror(err));
         goto done;
     }
 
+    // Have the driver timestamp every pointer update, so the streams can
+    // tell when the position they read was current.
+    if (snd_pcm_sw_params_set_tstamp_mode(handle->handle, softwareParams,
+            SND_PCM_TSTAMP_ENABLE) < 0)
+        LOGW("Unable to enable %s timestamps", streamName(handle));
+
     // Commit the software parameters back to the device.
     err = snd_pcm_sw_params(handle->handle, softwareParams);
     if (err < 0) LOGE("Unable to configure software parameters: %s",
             snd_strerror(err));
+    else {
+        handle->curStartThreshold = startThreshold;
+        handle->curAvailMin = availMin;
+    }
 
     done:
     snd_pcm_sw_params_free(softwareParams);
@@ -426,29 +770,523 @@ status_t setSoftwareParams(alsa_handle_t *handle)
 
 // ----------------------------------------------------------------------------
 
-static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
+// Longest chain of slave PCMs followed when resolving a definition.
+#define ALSA_SLAVE_DEPTH_MAX 8
+
+static int slaveOfName(const char *name, int *card, int *device, int depth);
+
+//
+// Follow a PCM definition through its slaves down to the hw PCM it ends up
+// on. Only hooks layers are allowed on the way, as they are the only plugin
+// that does not change the stream itself.
+//
+static int slaveOfConfig(snd_config_t *conf, int *card, int *device, int depth)
 {
-    list.clear();
+    snd_config_t *node;
+    const char *str;
+    long val;
 
-    snd_pcm_uframes_t bufferSize = _defaultsOut.bufferSize;
+    if (depth > ALSA_SLAVE_DEPTH_MAX) return -ELOOP;
 
-    for (size_t i = 1; (bufferSize & ~i) != 0; i <<= 1)
-        bufferSize &= ~i;
+    if (snd_config_get_type(conf) == SND_CONFIG_TYPE_STRING) {
+        if (snd_config_get_string(conf, &str) < 0) return -EINVAL;
+        return slaveOfName(str, card, device, depth + 1);
+    }
+
+    if (snd_config_search(conf, "type", &node) < 0 ||
+        snd_config_get_string(node, &str) < 0) return -EINVAL;
+
+    if (strcmp(str, "hw") == 0) {
+        *card = 0;
+        *device = 0;
+
+        if (snd_config_search(conf, "card", &node) == 0) {
+            if (snd_config_get_integer(node, &val) == 0)
+                *card = val;
+            else if (snd_config_get_string(node, &str) == 0)
+                *card = snd_card_get_index(str);
+            else
+                return -EINVAL;
+        }
+
+        if (snd_config_search(conf, "device", &node) == 0) {
+            if (snd_config_get_integer(node, &val) < 0) return -EINVAL;
+            *device = val;
+        }
+
+        return *card < 0 ? -ENODEV : 0;
+    }
+
+    if (strcmp(str, "hooks") != 0) return -EINVAL;
+
+    if (snd_config_search(conf, "slave.pcm", &node) < 0) return -EINVAL;
+
+    return slaveOfConfig(node, card, device, depth + 1);
+}
+
+static int slaveOfName(const char *name, int *card, int *device, int depth)
+{
+    snd_config_t *conf;
+
+    int err = snd_config_search_definition(snd_config, "pcm", name, &conf);
+    if (err < 0) return err;
+
+    err = slaveOfConfig(conf, card, device, depth);
+    snd_config_delete(conf);
+
+    return err;
+}
+
+//
+// The hooks of a PCM definition, or none. These are the mixer switches that
+// make the difference between two routes on one PCM. Anything but ctl_elems
+// needs the PCM to be reopened.
+//
+static int ctlElemsHooks(snd_config_t *conf, snd_config_t **hooks)
+{
+    snd_config_iterator_t i, next;
+    snd_config_t *node;
+    const char *str;
+
+    if (snd_config_search(conf, "hooks", hooks) < 0) {
+        *hooks = 0;
+        return 0;
+    }
+
+    snd_config_for_each(i, next, *hooks) {
+        snd_config_t *hook = snd_config_iterator_entry(i);
+        if (snd_config_search(hook, "type", &node) < 0 ||
+            snd_config_get_string(node, &str) < 0 ||
+            strcmp(str, "ctl_elems") != 0) return -ENOSYS;
+    }
+
+    return 0;
+}
+
+//
+// Apply the ctl_elems hooks of a PCM definition to the card.
+//
+static int applyHooks(snd_config_t *conf, int card)
+{
+    snd_config_iterator_t i, next;
+    snd_config_t *hooks, *node;
+    char ctlName[16];
+    snd_ctl_t *ctl;
+    int err;
+
+    err = ctlElemsHooks(conf, &hooks);
+    if (err < 0 || !hooks) return err;
+
+    snprintf(ctlName, sizeof(ctlName), "hw:%d", card);
+
+    err = snd_ctl_open(&ctl, ctlName, 0);
+    if (err < 0) return err;
 
-    _defaultsOut.module = module;
-    _defaultsOut.bufferSize = bufferSize;
+    snd_config_for_each(i, next, hooks) {
+        snd_config_t *hook = snd_config_iterator_entry(i);
+        snd_sctl_t *sctl;
 
-    list.push_back(_defaultsOut);
+        if (snd_config_search(hook, "hook_args", &node) < 0) continue;
 
-    bufferSize = _defaultsIn.bufferSize;
+        err = snd_sctl_build(&sctl, ctl, node, NULL, 0);
+        if (err < 0) break;
+
+        err = snd_sctl_install(sctl);
+        snd_sctl_free(sctl);
+        if (err < 0) break;
+    }
+
+    snd_ctl_close(ctl);
+
+    return err < 0 ? err : 0;
+}
+
+//
+// The control an element of a ctl_elems hook sets, as snd_sctl_build()
+// looks it up, with the defaults filled in.
+//
+static void elemKey(snd_config_t *elem, char *key, size_t size)
+{
+    static const char *fields[] = { "iface", "name", "index", "device",
+                                    "subdevice" };
+    static const char *defaults[] = { "MIXER", "", "0", "0", "0" };
+
+    key[0] = 0;
+
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        snd_config_t *node;
+        char *value = 0;
+        size_t len = strlen(key);
+
+        if (snd_config_search(elem, fields[f], &node) == 0)
+            snd_config_get_ascii(node, &value);
+
+        snprintf(key + len, size - len, "%s|", value ? value : defaults[f]);
+        free(value);
+
+        // The interface is matched without regard to case.
+        if (f == 0)
+            for (char *c = key + len; *c; c++) *c = toupper(*c);
+    }
+}
+
+static bool hooksSet(snd_config_t *hooks, const char *key)
+{
+    snd_config_iterator_t i, next, j, nextElem;
+    snd_config_t *args;
+    char elemName[ALSA_NAME_MAX];
+
+    snd_config_for_each(i, next, hooks) {
+        snd_config_t *hook = snd_config_iterator_entry(i);
+
+        if (snd_config_search(hook, "hook_args", &args) < 0) continue;
+
+        snd_config_for_each(j, nextElem, args) {
+            elemKey(snd_config_iterator_entry(j), elemName, sizeof(elemName));
+            if (strcmp(elemName, key) == 0) return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Whether the hooks set every control the other hooks do, so that applying
+// them leaves none of the other route's switches behind.
+//
+static bool hooksCover(snd_config_t *hooks, snd_config_t *others)
+{
+    snd_config_iterator_t i, next, j, nextElem;
+    snd_config_t *args;
+    char elemName[ALSA_NAME_MAX];
+
+    snd_config_for_each(i, next, others) {
+        snd_config_t *hook = snd_config_iterator_entry(i);
+
+        if (snd_config_search(hook, "hook_args", &args) < 0) continue;
+
+        snd_config_for_each(j, nextElem, args) {
+            elemKey(snd_config_iterator_entry(j), elemName, sizeof(elemName));
+            if (!hooks || !hooksSet(hooks, elemName)) return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// Take back the switches of a hot route, newest first, which puts back the
+// values the elements marked preserve had before.
+//
+static void dropRouteHooks(alsa_handle_private_t *priv)
+{
+    for (int i = ALSA_ROUTE_HOOKS_MAX - 1; i >= 0; i--)
+        if (priv->routeSctl[i]) {
+            snd_sctl_remove(priv->routeSctl[i]);
+            snd_sctl_free(priv->routeSctl[i]);
+            priv->routeSctl[i] = 0;
+        }
+
+    if (priv->routeCtl) {
+        snd_ctl_close(priv->routeCtl);
+        priv->routeCtl = 0;
+    }
+}
+
+//
+// Apply the ctl_elems hooks of a hot route, keeping them so that they can be
+// taken back like the PCM's own hooks are when it closes.
+//
+static int installRouteHooks(alsa_handle_private_t *priv, snd_config_t *hooks,
+                             int card)
+{
+    snd_config_iterator_t i, next;
+    snd_config_t *node;
+    char ctlName[16];
+    int count = 0;
+    int err;
+
+    snprintf(ctlName, sizeof(ctlName), "hw:%d", card);
+
+    err = snd_ctl_open(&priv->routeCtl, ctlName, 0);
+    if (err < 0) {
+        priv->routeCtl = 0;
+        return err;
+    }
+
+    snd_config_for_each(i, next, hooks) {
+        snd_config_t *hook = snd_config_iterator_entry(i);
+
+        if (snd_config_search(hook, "hook_args", &node) < 0) continue;
+
+        if (count == ALSA_ROUTE_HOOKS_MAX) {
+            err = -ENOSPC;
+            break;
+        }
+
+        err = snd_sctl_build(&priv->routeSctl[count], priv->routeCtl, node,
+                NULL, 0);
+        if (err < 0) {
+            priv->routeSctl[count] = 0;
+            break;
+        }
+
+        err = snd_sctl_install(priv->routeSctl[count++]);
+        if (err < 0) break;
+    }
+
+    if (err < 0) dropRouteHooks(priv);
+
+    return err < 0 ? err : 0;
+}
+
+//
+// Recently closed PCMs are kept open and set up in a small pool, so that
+// going back to a recent route costs a snd_pcm_prepare() instead of an open
+// and a full parameter negotiation. Entries are keyed by the handle whose
+// configuration they were set up with, the name the PCM was opened by and
+// the mode. An idle PCM keeps the hardware open and the codec powered, so
+// entries are closed after ALSA_PCM_POOL_IDLE_MS.
+//
+struct alsa_pooled_pcm_t {
+    snd_pcm_t *             pcm;
+    const alsa_handle_t *   owner;
+    int                     mode;
+    unsigned int            lastUsed;
+    int64_t                 idleSince;  // CLOCK_MONOTONIC msec
+    alsa_handle_t           params;     // Negotiated parameters
+    char                    name[ALSA_NAME_MAX];
+};
+
+static alsa_pooled_pcm_t pcmPool[ALSA_PCM_POOL_SIZE ? ALSA_PCM_POOL_SIZE : 1];
+static unsigned int pcmPoolClock;
+static bool pcmPoolReaping;
+static Mutex pcmPoolLock;
+
+static int64_t monotonicMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//
+// Close pooled PCMs as they run out of idle time, and go away once the
+// pool is empty. poolPut() starts it again.
+//
+static void *poolReaper(void *)
+{
+    for (;;) {
+        int64_t wait = 0;
+
+        {
+            AutoMutex lock(pcmPoolLock);
+            int64_t now = monotonicMsec();
+
+            for (int i = 0; i < ALSA_PCM_POOL_SIZE; i++) {
+                if (!pcmPool[i].pcm) continue;
+
+                int64_t left = pcmPool[i].idleSince + ALSA_PCM_POOL_IDLE_MS - now;
+
+                if (left <= 0) {
+                    LOGV("Closing idle pooled ALSA device %s", pcmPool[i].name);
+                    snd_pcm_close(pcmPool[i].pcm);
+                    pcmPool[i].pcm = 0;
+                } else if (!wait || left < wait)
+                    wait = left;
+            }
+
+            if (!wait) {
+                pcmPoolReaping = false;
+                return 0;
+            }
+        }
+
+        usleep(wait * 1000);
+    }
+}
+
+static void restoreParams(alsa_handle_t *handle, const alsa_handle_t *params)
+{
+    handle->sampleRate = params->sampleRate;
+    handle->latency = params->latency;
+    handle->bufferSize = params->bufferSize;
+    handle->curStartThreshold = params->curStartThreshold;
+    handle->curAvailMin = params->curAvailMin;
+    handle->curAccess = params->curAccess;
+}
+
+//
+// Keep a drained PCM for later. The least recently used entry makes room
+// when the pool is full. Returns false if the PCM was not taken.
+//
+static bool poolPut(alsa_handle_t *handle, snd_pcm_t *pcm, const char *name,
+        int mode)
+{
+    if (!ALSA_PCM_POOL_SIZE) return false;
+
+    AutoMutex lock(pcmPoolLock);
+
+    alsa_pooled_pcm_t *entry = &pcmPool[0];
+
+    for (int i = 0; i < ALSA_PCM_POOL_SIZE; i++) {
+        if (!pcmPool[i].pcm) {
+            entry = &pcmPool[i];
+            break;
+        }
+        if (pcmPool[i].lastUsed < entry->lastUsed) entry = &pcmPool[i];
+    }
+
+    if (entry->pcm) {
+        LOGV("Evicting pooled ALSA device %s", entry->name);
+        snd_pcm_close(entry->pcm);
+    }
+
+    entry->pcm = pcm;
+    entry->owner = handle;
+    entry->mode = mode;
+    entry->lastUsed = ++pcmPoolClock;
+    entry->idleSince = monotonicMsec();
+    entry->params = *handle;
+    strncpy(entry->name, name, ALSA_NAME_MAX - 1);
+    entry->name[ALSA_NAME_MAX - 1] = '\0';
+
+    if (!pcmPoolReaping) {
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if (pthread_create(&thread, &attr, poolReaper, 0) == 0)
+            pcmPoolReaping = true;
+        else
+            LOGW("Unable to start the pool reaper, idle PCMs stay open");
+
+        pthread_attr_destroy(&attr);
+    }
+
+    return true;
+}
+
+//
+// Reapply the mixer switches of a pooled PCM, as other routes may have
+// changed them since it was set up.
+//
+static int poolRestoreHooks(snd_pcm_t *pcm)
+{
+    snd_pcm_info_t *info;
+    snd_config_t *conf;
+
+    if (!snd_config) return 0;
+
+    if (snd_config_search_definition(snd_config, "pcm", snd_pcm_name(pcm),
+            &conf) < 0) return 0;
+
+    snd_pcm_info_alloca(&info);
+    int err = snd_pcm_info(pcm, info);
+    if (err == 0) err = applyHooks(conf, snd_pcm_info_get_card(info));
+
+    snd_config_delete(conf);
+
+    return err;
+}
+
+static status_t poolTake(alsa_handle_t *handle, const char *name, int mode)
+{
+    if (!ALSA_PCM_POOL_SIZE) return NAME_NOT_FOUND;
+
+    alsa_pooled_pcm_t entry;
+
+    {
+        AutoMutex lock(pcmPoolLock);
+
+        int i;
+        for (i = 0; i < ALSA_PCM_POOL_SIZE; i++)
+            if (pcmPool[i].pcm && pcmPool[i].owner == handle &&
+                pcmPool[i].mode == mode && strcmp(pcmPool[i].name, name) == 0)
+                break;
+
+        if (i == ALSA_PCM_POOL_SIZE) return NAME_NOT_FOUND;
+
+        entry = pcmPool[i];
+        pcmPool[i].pcm = 0;
+    }
+
+    int err = poolRestoreHooks(entry.pcm);
+    if (err == 0) err = snd_pcm_prepare(entry.pcm);
+
+    if (err < 0) {
+        LOGW("Unable to reuse pooled ALSA device %s: %s", name,
+                snd_strerror(err));
+        snd_pcm_close(entry.pcm);
+        return NO_INIT;
+    }
+
+    handle->handle = entry.pcm;
+    restoreParams(handle, &entry.params);
+
+    return NO_ERROR;
+}
+
+//
+// Close every pooled PCM. Used when an open finds the device busy, as the
+// pool may be what is holding it.
+//
+static int poolFlush()
+{
+    AutoMutex lock(pcmPoolLock);
+    int count = 0;
+
+    for (int i = 0; i < ALSA_PCM_POOL_SIZE; i++)
+        if (pcmPool[i].pcm) {
+            snd_pcm_close(pcmPool[i].pcm);
+            pcmPool[i].pcm = 0;
+            count++;
+        }
+
+    return count;
+}
+
+static void s_add_handle(alsa_device_t *module, ALSAHandleList &list,
+        alsa_handle_t *handle)
+{
+    snd_pcm_uframes_t bufferSize = handle->bufferSize;
 
     for (size_t i = 1; (bufferSize & ~i) != 0; i <<= 1)
         bufferSize &= ~i;
 
-    _defaultsIn.module = module;
-    _defaultsIn.bufferSize = bufferSize;
+    handle->module = module;
+    handle->bufferSize = bufferSize;
+
+    // The defaults outlive the list, so this is only done once per handle.
+    if (!handle->modPrivate) {
+        alsa_handle_private_t *priv = new alsa_handle_private_t;
+
+        if (snd_pcm_hw_params_malloc(&priv->hardwareParams) < 0)
+            priv->hardwareParams = 0;
+
+        priv->routeCtl = 0;
+        memset(priv->routeSctl, 0, sizeof(priv->routeSctl));
+
+        handle->modPrivate = priv;
+    }
+
+    list.push_back(*handle);
+}
+
+static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
+{
+    list.clear();
+
+    resolveDeviceNames();
 
-    list.push_back(_defaultsIn);
+    s_add_handle(module, list, &_defaultsOut);
+    s_add_handle(module, list, &_defaultsOutLowLatency);
+    s_add_handle(module, list, &_defaultsOutDeepBuffer);
+    s_add_handle(module, list, &_defaultsIn);
 
     return NO_ERROR;
 }
@@ -465,10 +1303,23 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
     LOGD("open called for devices %08x in mode %d...", devices, mode);
 
     const char *stream = streamName(handle);
-    const char *devName = deviceName(handle, devices, mode);
+    char devName[ALSA_NAME_MAX];
+
+    strcpy(devName, deviceName(handle, devices, mode));
 
     int err;
 
+    if (poolTake(handle, devName, mode) == NO_ERROR) {
+        LOGI("Reused ALSA %s device %s (%s access)", stream,
+                snd_pcm_name(handle->handle),
+                snd_pcm_access_name(handle->curAccess));
+
+        handle->curDev = devices;
+        handle->curMode = mode;
+
+        return NO_ERROR;
+    }
+
     for (;;) {
         // The PCM stream is opened in blocking mode, per ALSA defaults.  The
         // AudioFlinger seems to assume blocking mode too, so asynchronous mode
@@ -477,16 +1328,21 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
                 SND_PCM_ASYNC);
         if (err == 0) break;
 
+        // A pooled PCM may be holding the hardware.
+        if (err == -EBUSY && poolFlush()) continue;
+
+        LOGW("Unable to open ALSA %s device %s: %s", stream, devName,
+                snd_strerror(err));
+
         // See if there is a less specific name we can try.
-        // Note: We are changing the contents of a const char * here.
         char *tail = strrchr(devName, '_');
         if (!tail) break;
         *tail = 0;
     }
 
-    if (err < 0) {
+    if (err < 0 && strcmp(devName, "default") != 0) {
         // None of the Android defined audio devices exist. Open a generic one.
-        devName = "default";
+        strcpy(devName, "default");
         err = snd_pcm_open(&handle->handle, devName, direction(handle), 0);
     }
 
@@ -500,7 +1356,8 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
 
     if (err == NO_ERROR) err = setSoftwareParams(handle);
 
-    LOGI("Initialized ALSA %s device %s", stream, devName);
+    LOGI("Initialized ALSA %s device %s (%s access)", stream, devName,
+            snd_pcm_access_name(handle->curAccess));
 
     handle->curDev = devices;
     handle->curMode = mode;
@@ -512,23 +1369,117 @@ static status_t s_close(alsa_handle_t *handle)
 {
     status_t err = NO_ERROR;
     snd_pcm_t *h = handle->handle;
+    int mode = handle->curMode;
+
+    // Only handles from the list are pooled. Copies, such as the sinks of
+    // an output played on several devices, come and go with their streams.
+    if (h && handle->modPrivate) {
+        // Take back the switches of a hot route first, so that the PCM's
+        // own hooks put back what they found when it was opened.
+        dropRouteHooks(static_cast<alsa_handle_private_t *>(handle->modPrivate));
+
+        // Only a PCM that drained cleanly is worth keeping. Streams put in
+        // standby are already drained.
+        bool drained = snd_pcm_state(h) == SND_PCM_STATE_SETUP ||
+                       snd_pcm_drain(h) == 0;
+
+        // Pooled by the name it was opened by, which after a hot route is
+        // not the one curDev gives, so that it is only ever taken for the
+        // route its mixer switches belong to.
+        if (drained && poolPut(handle, h, snd_pcm_name(h), mode))
+            h = 0;
+    }
+
     handle->handle = 0;
     handle->curDev = 0;
     handle->curMode = 0;
-    if (h) {
-        snd_pcm_drain(h);
-        err = snd_pcm_close(h);
-    }
+    handle->curAccess = SND_PCM_ACCESS_RW_INTERLEAVED;
+    handle->curStartThreshold = 0;
+    handle->curAvailMin = 0;
+    if (h) err = snd_pcm_close(h);
 
     return err;
 }
 
+//
+// Switch routes without closing the PCM when the new route's PCM definition
+// ends up on the same hardware PCM as the open one. Only its mixer switches
+// are applied, so playback carries on without draining the buffer.
+//
+// The switches of the route the PCM was opened for stay with it until it is
+// closed, so the new route has to set every one of them. Those of an earlier
+// hot route are taken back first.
+//
+static status_t s_hot_route(alsa_handle_t *handle, uint32_t devices, int mode)
+{
+    alsa_handle_private_t *priv =
+            static_cast<alsa_handle_private_t *>(handle->modPrivate);
+    snd_pcm_info_t *info;
+    snd_config_t *conf = 0, *openConf = 0;
+    snd_config_t *hooks = 0, *openHooks = 0;
+    int card, device;
+    int err;
+
+    // Copies of handles have nowhere to keep the switches they set.
+    if (!snd_config || !priv) return INVALID_OPERATION;
+
+    snd_pcm_info_alloca(&info);
+    if (snd_pcm_info(handle->handle, info) < 0) return INVALID_OPERATION;
+
+    const char *devName = deviceName(handle, devices, mode);
+    const char *openName = snd_pcm_name(handle->handle);
+    bool ownRoute = strcmp(devName, openName) == 0;
+
+    err = snd_config_search_definition(snd_config, "pcm", devName, &conf);
+    if (err < 0) return INVALID_OPERATION;
+
+    err = snd_config_search_definition(snd_config, "pcm", openName, &openConf);
+    if (err < 0) openConf = 0;
+
+    if (err == 0) err = slaveOfConfig(conf, &card, &device, 0);
+
+    if (err == 0 && (card != snd_pcm_info_get_card(info) ||
+                     device != (int)snd_pcm_info_get_device(info)))
+        err = -ENODEV;
+
+    if (err == 0) err = ctlElemsHooks(conf, &hooks);
+    if (err == 0) err = ctlElemsHooks(openConf, &openHooks);
+
+    if (err == 0 && !ownRoute && !hooksCover(hooks, openHooks))
+        err = -EBUSY;
+
+    if (err == 0) {
+        dropRouteHooks(priv);
+
+        if (ownRoute)
+            err = applyHooks(conf, card);
+        else if (hooks)
+            err = installRouteHooks(priv, hooks, card);
+    }
+
+    snd_config_delete(conf);
+    if (openConf) snd_config_delete(openConf);
+
+    if (err < 0) return INVALID_OPERATION;
+
+    LOGI("Hot routed ALSA %s device to %s on hw:%d,%d", streamName(handle),
+            devName, card, device);
+
+    handle->curDev = devices;
+    handle->curMode = mode;
+
+    return NO_ERROR;
+}
+
 static status_t s_route(alsa_handle_t *handle, uint32_t devices, int mode)
 {
     LOGD("route called for devices %08x in mode %d...", devices, mode);
 
     if (handle->handle && handle->curDev == devices && handle->curMode == mode) return NO_ERROR;
 
+    if (handle->handle && s_hot_route(handle, devices, mode) == NO_ERROR)
+        return NO_ERROR;
+
     return s_open(handle, devices, mode);
 }
 